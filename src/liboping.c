@@ -32,6 +32,7 @@
 # include <inttypes.h>
 # include <errno.h>
 # include <assert.h>
+# include <limits.h>
 #else
 # error "You don't have the standard C99 header files installed"
 #endif /* STDC_HEADERS */
@@ -73,12 +74,22 @@
 # include <netdb.h>
 #endif
 
+#if HAVE_SYS_EPOLL_H && HAVE_EPOLL_CREATE1
+# include <sys/epoll.h>
+# define PING_USE_EPOLL 1
+#elif HAVE_POLL_H
+# include <poll.h>
+#endif
+
 #if HAVE_NETINET_IN_SYSTM_H
 # include <netinet/in_systm.h>
 #endif
 #if HAVE_NETINET_IN_H
 # include <netinet/in.h>
 #endif
+#if HAVE_ARPA_INET_H
+# include <arpa/inet.h>
+#endif
 #if HAVE_NETINET_IP_H
 # include <netinet/ip.h>
 #endif
@@ -95,6 +106,22 @@
 # include <netinet/icmp6.h>
 #endif
 
+#if HAVE_LINUX_FILTER_H && defined(SO_ATTACH_FILTER)
+# include <linux/filter.h>
+# define PING_USE_BPF 1
+#endif
+
+#if HAVE_LINUX_NET_TSTAMP_H && HAVE_LINUX_ERRQUEUE_H && defined(SO_TIMESTAMPING)
+# include <linux/net_tstamp.h>
+# include <linux/errqueue.h>
+# define PING_USE_TIMESTAMPING 1
+#endif
+
+#if HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE
+# include <pthread.h>
+# define PING_USE_THREADS 1
+#endif
+
 #include "oping.h"
 
 #if WITH_DEBUG
@@ -104,43 +131,231 @@
 #endif
 
 #define PING_ERRMSG_LEN 256
-#define PING_TABLE_LEN 5381
+#define PING_PACKET_LEN 4096
+#define PING_CONTROL_LEN 256
+
+/* The token bucket used for pacing holds at most this many seconds worth of
+ * echo requests, but at least one. */
+#define PING_PACE_BURST 0.001
+
+/* In continuous mode, an echo request that could not be sent because the
+ * socket's send buffer was full is retried after this many seconds. */
+#define PING_SEND_RETRY 0.001
+
+/* Number of threads resolving host names in "ping_host_add_many". */
+#define PING_RESOLVE_THREADS 32
+
+/* Number of sequence number bits counting a host's echo requests, see
+ * "ping_slot_alloc". The remaining bits tell apart hosts that share an ident,
+ * which limits the number of hosts to PING_MAX_SLOTS. */
+#define PING_SEQ_BITS 12
+#define PING_SEQ_MASK ((1 << PING_SEQ_BITS) - 1)
+#define PING_MAX_SLOTS (0x10000 << (16 - PING_SEQ_BITS))
+
+/* Number of echo requests per host that may be outstanding at the same time,
+ * see "ping_probe_timer". Must be a power of two. */
+#define PING_WINDOW_LEN 16
+
+/* Length of the header at the start of the echo request's data with
+ * PING_OPT_PAYLOAD_HEADER, see "ping_payload_write". */
+#define PING_PAYLOAD_HEADER_LEN 16
+#define PING_PAYLOAD_STAMP_OFFSET 8
+
+/* Number of iovecs of an echo request and length of the template of its
+ * start, see "ping_packet_prepare". */
+#define PING_PACKET_IOV_LEN 2
+#define PING_PACKET_TEMPLATE_LEN (ICMP_MINLEN + PING_PAYLOAD_HEADER_LEN)
+
+/* Receive timestamps: nanoseconds where the kernel provides them. */
+#if defined(SO_TIMESTAMPNS)
+# define PING_SO_TIMESTAMP SO_TIMESTAMPNS
+#elif defined(SO_TIMESTAMP)
+# define PING_SO_TIMESTAMP SO_TIMESTAMP
+#endif
 
-struct pinghost
+/* Number of echo requests per socket whose kernel transmit timestamp may be
+ * outstanding, see "ping_tx_sent". Must be a power of two. */
+#define PING_TX_STAMPS_LEN 4096
+
+/* Readiness flags of the raw sockets, see "ping_event_wait". */
+#define PING_FD_READABLE 0x01
+#define PING_FD_WRITABLE 0x02
+
+struct pingdata
+{
+	size_t                   refs;
+	size_t                   size;
+	uint64_t                 sum;
+	char                     data[];
+};
+
+/* A host's address. Hosts are IPv4 or IPv6 hosts only, so this is much
+ * smaller than a "struct sockaddr_storage". */
+union pingaddr
 {
+	struct sockaddr          sa;
+	struct sockaddr_in       sin;
+	struct sockaddr_in6      sin6;
+};
+
+/* Host state that hosts added by address range mostly do without, allocated
+ * on first use, see "ping_host_ext". */
+struct pinghostext
+{
+	/* Round-trip times of the last replies in milliseconds, see
+	 * "ping_host_record_rtt". */
+	double                   rtt_history[PING_RTT_HISTORY_LEN];
+	uint32_t                 rtt_history_num;
+
+	/* Whether the host was added by name, whether it is one of the hosts
+	 * added for all addresses of that name, see "ping_host_add_all", and
+	 * when it was resolved last, see "ping_refresh". */
+	int                      resolve;
+	int                      resolve_all;
+	struct timespec           resolved;
+
 	/* username: name passed in by the user */
 	char                    *username;
-	/* hostname: name returned by the reverse lookup */
+	/* hostname: name returned by the reverse lookup; the same string as
+	 * username until the lookup returns a different name. */
 	char                    *hostname;
-	struct sockaddr_storage *addr;
-	socklen_t                addrlen;
+};
+
+struct pinghost
+{
+	/* Fields used by every round come first, see "ping_alloc". */
+	struct pinghost         *next;
 	int                      addrfamily;
+	uint32_t                 slot;
 	int                      ident;
 	int                      sequence;
-	struct timeval          *timer;
-	double                   latency;
+	/* Send times of the outstanding echo requests, "window" entries, and
+	 * the number of entries in use, see "ping_probe_timer". */
+	struct timespec          *timer;
+	uint32_t                 window;
+	int                      pending;
 	uint32_t                 dropped;
+	uint32_t                 answered;
+	double                   latency;
+	int64_t                  latency_ns;
+	/* Smoothed RTT and its variation, in seconds; srtt is less than zero
+	 * until the first reply. See "ping_host_timeout". */
+	double                   srtt;
+	double                   rttvar;
 	int                      recv_ttl;
 	uint8_t                  recv_qos;
-	char                    *data;
+
+	/* Continuous mode: the host's own interval (zero to use the object's),
+	 * the time of the next echo request and of the next event, the host's
+	 * index in the scheduler heap (-1 if not scheduled) and whether the
+	 * callback removed it, see "ping_host_notify". */
+	double                   interval;
+	struct timespec           next_send;
+	struct timespec           due;
+	int                      heap_index;
+	int                      removed;
+
+	/* The echo request template, see "ping_packet_prepare". */
+	uint64_t                 packet[PING_PACKET_TEMPLATE_LEN / 8];
+	size_t                   packet_len;
+	uint64_t                 packet_sum;
+	int                      packet_header;
+	struct pingdata         *data;
+	union pingaddr           addr;
+	socklen_t                addrlen;
+	/* Next host in the same bucket of the address index, see
+	 * "ping_addr_lookup". */
+	struct pinghost         *addr_next;
+
+	/* Previous host in the list and next host in the same bucket of the
+	 * name index, see "ping_name_lookup". */
+	struct pinghost         *prev;
+	struct pinghost         *name_next;
+	uint32_t                 name_hash;
+
+	/* The only entry of "timer" until the window grows, see
+	 * "ping_probe_grow", and the rarely used state, see "ping_host_ext". */
+	struct timespec           timer_one;
+	struct pinghostext      *ext;
 
 	void                    *context;
+};
 
-	struct pinghost         *next;
-	struct pinghost         *table_next;
+/* A block of host records, see "ping_alloc". */
+struct pinghostblock
+{
+	struct pinghostblock    *next;
+	size_t                   size;
+	size_t                   used;
+	pinghost_t               hosts[];
+};
+
+/* An echo request waiting for its kernel transmit timestamp: the socket's
+ * number for it and the host's slot and ICMP sequence number. */
+struct pingtxstamp
+{
+	uint32_t                 key;
+	uint32_t                 slot;
+	uint16_t                 seq;
+	uint16_t                 valid;
+};
+
+/* "enabled" is set while SO_TIMESTAMPING is on. "stamps" stays allocated
+ * when it is turned off, so timestamps still queued are read and dropped. */
+struct pingtx
+{
+	uint32_t                 key;
+	struct pingtxstamp      *stamps;
+	int                      enabled;
 };
 
 struct pingobj
 {
 	double                   timeout;
+	double                   timeout_min;
+	int                      timeout_adaptive;
 	int                      ttl;
 	int                      addrfamily;
 	uint8_t                  qos;
-	char                    *data;
+	struct pingdata         *data;
+	size_t                   data_max;
+	int                      payload_header;
+	uint32_t                 cookie;
+	int                      timestamping;
+	int                      dgram;
+	int                      skip_checksum;
 
 	int                      fd4;
 	int                      fd6;
 
+	/* Readiness of fd4 and fd6. Flags are set by "ping_event_wait" and
+	 * cleared when a read or write returns EAGAIN. */
+	int                      fd4_ready;
+	int                      fd6_ready;
+	/* Transmit timestamps of fd4 and fd6, see "ping_tx_sent". */
+	struct pingtx            tx4;
+	struct pingtx            tx6;
+#if PING_USE_EPOLL
+	int                      efd;
+#endif
+
+	/* Buffers for sending and receiving up to batch_size packets at
+	 * once, see "ping_batch_alloc". */
+	int                      batch_size;
+	pinghost_t             **send_hosts;
+#if HAVE_SENDMMSG
+	struct mmsghdr          *send_msgs;
+	struct iovec            *send_iov;
+#endif
+	char                    *recv_buffer;
+	size_t                   recv_len;
+	char                    *recv_control;
+	struct sockaddr_storage *recv_addrs;
+#if HAVE_RECVMMSG
+	struct mmsghdr          *recv_msgs;
+	struct iovec            *recv_iov;
+#endif
+
 	struct sockaddr         *srcaddr;
 	socklen_t                srcaddrlen;
 
@@ -151,8 +366,81 @@ struct pingobj
 
 	char                     errmsg[PING_ERRMSG_LEN];
 
+	/* State of the current round, see "ping_send_start". host_to_ping4
+	 * and host_to_ping6 point to the next IPv4 and IPv6 host to send a
+	 * "ping" to. pings_in_flight is the number of hosts we sent a "ping"
+	 * to but didn't receive a "pong" yet. */
+	int                      round_active;
+	struct timespec           round_end;
+	pinghost_t              *host_to_ping4;
+	pinghost_t              *host_to_ping6;
+	int                      pings_in_flight;
+	int                      pongs_received;
+	int                      error_count;
+	int                      pings_expired;
+
+	/* Pacing, see "ping_pace_tokens". pace_rate is the rate of the
+	 * current round derived from send_rate and send_spread; zero means
+	 * unlimited. */
+	double                   send_rate;
+	double                   send_spread;
+	double                   pace_rate;
+	double                   pace_tokens;
+	struct timespec           pace_time;
+
+	/* State of continuous mode, see "ping_run_start". */
+	int                      run_active;
+	double                   interval;
+	pinghost_t             **heap;
+	size_t                   heap_len;
+	size_t                   heap_size;
+	ping_callback_t          callback;
+	void                    *callback_arg;
+	/* Non-zero while the callback runs. Hosts it removes are kept in
+	 * hosts_removed until it has returned, see "ping_host_reap". */
+	int                      callback_active;
+	pinghost_t              *hosts_removed;
+
+	/* Hosts by slot number, see "ping_slot_alloc". slots_free holds the
+	 * numbers of unused slots below slots_num. */
+	uint16_t                 ident_base;
+	pinghost_t             **slots;
+	uint32_t                *slots_free;
+	size_t                   slots_num;
+	size_t                   slots_free_num;
+	size_t                   slots_size;
+	/* Size of the slot table when the socket filters were attached, see
+	 * "ping_filter_update". */
+	size_t                   filter_size;
+
+	/* Hosts by address, see "ping_addr_lookup". */
+	pinghost_t             **addrs;
+	size_t                   addrs_size;
+
+	/* All hosts in the order they were added, and hosts by name, see
+	 * "ping_name_lookup". */
 	pinghost_t              *head;
-	pinghost_t              *table[PING_TABLE_LEN];
+	pinghost_t              *tail;
+	size_t                   hosts_num;
+	pinghost_t             **names;
+	size_t                   names_size;
+
+	/* Resolver cache, see "ping_refresh". refresh holds the hosts being
+	 * resolved by refresh_thread, refresh_next the next host to check. */
+	double                   resolve_ttl;
+	int                      all_addresses;
+	struct pingresolver     *refresh;
+	pinghost_t              *refresh_next;
+	ping_host_callback_t     host_callback;
+	void                    *host_callback_arg;
+#if PING_USE_THREADS
+	pthread_t                refresh_thread;
+#endif
+
+	/* Host records, see "ping_alloc". */
+	struct pinghostblock    *host_blocks;
+	pinghost_t              *hosts_free;
+	size_t                   hosts_free_num;
 };
 
 /*
@@ -213,778 +501,3820 @@ static void ping_set_errno (pingobj_t *obj, int error_number)
 	sstrerror (error_number, obj->errmsg, sizeof (obj->errmsg));
 }
 
-static int ping_timeval_add (struct timeval *tv1, struct timeval *tv2,
-		struct timeval *res)
+/* ping_clock_now reads the clock used for all timing: CLOCK_MONOTONIC where
+ * available, so that changes to the system time don't affect round-trip
+ * times or timeouts. */
+static int ping_clock_now (struct timespec *ts)
 {
-	res->tv_sec  = tv1->tv_sec  + tv2->tv_sec;
-	res->tv_usec = tv1->tv_usec + tv2->tv_usec;
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+	return (clock_gettime (CLOCK_MONOTONIC, ts));
+#else
+	struct timeval tv;
 
-	while (res->tv_usec > 1000000)
-	{
-		res->tv_usec -= 1000000;
-		res->tv_sec++;
-	}
+	if (gettimeofday (&tv, NULL) == -1)
+		return (-1);
 
+	ts->tv_sec  = tv.tv_sec;
+	ts->tv_nsec = 1000 * (long) tv.tv_usec;
 	return (0);
+#endif
 }
 
-static int ping_timeval_sub (struct timeval *tv1, struct timeval *tv2,
-		struct timeval *res)
+static int ping_timespec_add (struct timespec *ts1, struct timespec *ts2,
+		struct timespec *res)
 {
-	if ((tv1->tv_sec < tv2->tv_sec)
-			|| ((tv1->tv_sec == tv2->tv_sec)
-				&& (tv1->tv_usec < tv2->tv_usec)))
-		return (-1);
-
-	res->tv_sec  = tv1->tv_sec  - tv2->tv_sec;
-	res->tv_usec = tv1->tv_usec - tv2->tv_usec;
+	res->tv_sec  = ts1->tv_sec  + ts2->tv_sec;
+	res->tv_nsec = ts1->tv_nsec + ts2->tv_nsec;
 
-	assert ((res->tv_sec > 0) || ((res->tv_sec == 0) && (res->tv_usec >= 0)));
-
-	while (res->tv_usec < 0)
+	while (res->tv_nsec >= 1000000000)
 	{
-		res->tv_usec += 1000000;
-		res->tv_sec--;
+		res->tv_nsec -= 1000000000;
+		res->tv_sec++;
 	}
 
 	return (0);
 }
 
-static uint16_t ping_icmp4_checksum (char *buf, size_t len)
+static int ping_timespec_sub (struct timespec *ts1, struct timespec *ts2,
+		struct timespec *res)
 {
-	uint32_t sum = 0;
-	uint16_t ret = 0;
+	if ((ts1->tv_sec < ts2->tv_sec)
+			|| ((ts1->tv_sec == ts2->tv_sec)
+				&& (ts1->tv_nsec < ts2->tv_nsec)))
+		return (-1);
 
-	uint16_t *ptr;
+	res->tv_sec  = ts1->tv_sec  - ts2->tv_sec;
+	res->tv_nsec = ts1->tv_nsec - ts2->tv_nsec;
 
-	for (ptr = (uint16_t *) buf; len > 1; ptr++, len -= 2)
-		sum += *ptr;
+	assert ((res->tv_sec > 0)
+			|| ((res->tv_sec == 0) && (res->tv_nsec >= 0)));
 
-	if (len == 1)
+	while (res->tv_nsec < 0)
 	{
-		*(char *) &ret = *(char *) ptr;
-		sum += ret;
+		res->tv_nsec += 1000000000;
+		res->tv_sec--;
 	}
 
-	/* Do this twice to get all possible carries.. */
-	sum = (sum >> 16) + (sum & 0xFFFF);
-	sum = (sum >> 16) + (sum & 0xFFFF);
-
-	ret = ~sum;
+	return (0);
+}
 
-	return (ret);
+static int ping_timespec_cmp (struct timespec *ts1, struct timespec *ts2)
+{
+	if (ts1->tv_sec != ts2->tv_sec)
+		return ((ts1->tv_sec < ts2->tv_sec) ? -1 : 1);
+	if (ts1->tv_nsec != ts2->tv_nsec)
+		return ((ts1->tv_nsec < ts2->tv_nsec) ? -1 : 1);
+	return (0);
 }
 
-static pinghost_t *ping_receive_ipv4 (pingobj_t *obj, char *buffer,
-		size_t buffer_len)
+static int ping_timespec_isset (struct timespec *ts)
 {
-	struct ip *ip_hdr;
-	struct icmp *icmp_hdr;
+	return ((ts->tv_sec != 0) || (ts->tv_nsec != 0));
+}
 
-	size_t ip_hdr_len;
+static void ping_timespec_clear (struct timespec *ts)
+{
+	ts->tv_sec  = 0;
+	ts->tv_nsec = 0;
+}
 
-	uint16_t recv_checksum;
-	uint16_t calc_checksum;
+static void ping_timespec_set (struct timespec *ts, double seconds)
+{
+	ts->tv_sec = (time_t) seconds;
+	ts->tv_nsec = (long) (1000000000 * (seconds - ((double) ts->tv_sec)));
+}
 
-	uint16_t ident;
-	uint16_t seq;
+static double ping_timespec_get (struct timespec *ts)
+{
+	return (((double) ts->tv_sec)
+			+ (((double) ts->tv_nsec) / 1000000000.0));
+}
 
-	pinghost_t *ptr;
+static int64_t ping_timespec_ns (struct timespec *ts)
+{
+	return ((((int64_t) ts->tv_sec) * 1000000000)
+			+ ((int64_t) ts->tv_nsec));
+}
 
-	if (buffer_len < sizeof (struct ip))
-		return (NULL);
+/* ping_clock_offset returns the difference between CLOCK_REALTIME, which
+ * kernel receive timestamps are taken from, and the clock of
+ * "ping_clock_now". Both are read back to back. */
+static int ping_clock_offset (struct timespec *offset)
+{
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+	struct timespec mono;
+	struct timespec real;
 
-	ip_hdr     = (struct ip *) buffer;
-	ip_hdr_len = ip_hdr->ip_hl << 2;
+	if ((clock_gettime (CLOCK_MONOTONIC, &mono) != 0)
+			|| (clock_gettime (CLOCK_REALTIME, &real) != 0))
+		return (-1);
 
-	if (buffer_len < ip_hdr_len)
-		return (NULL);
+	return (ping_timespec_sub (&real, &mono, offset));
+#else
+	offset->tv_sec  = 0;
+	offset->tv_nsec = 0;
+	return (0);
+#endif
+}
 
-	buffer     += ip_hdr_len;
-	buffer_len -= ip_hdr_len;
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Event functions:                                                          *
+ *                                                                           *
+ * The raw sockets are non-blocking. With epoll(7) they are registered once, *
+ * edge-triggered, when they are opened. Without it, poll(2) is used. Either *
+ * way, readiness is remembered in fd4_ready / fd6_ready until a read or     *
+ * write on the socket returns EAGAIN.                                       *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static int *ping_event_ready (pingobj_t *obj, int addrfam)
+{
+	return ((addrfam == AF_INET6) ? &obj->fd6_ready : &obj->fd4_ready);
+}
 
-	if (buffer_len < ICMP_MINLEN)
-		return (NULL);
+static int ping_event_add (pingobj_t *obj, int fd)
+{
+#if PING_USE_EPOLL
+	struct epoll_event ev;
 
-	icmp_hdr = (struct icmp *) buffer;
-	if (icmp_hdr->icmp_type != ICMP_ECHOREPLY)
+	if (obj->efd == -1)
 	{
-		dprintf ("Unexpected ICMP type: %"PRIu8"\n", icmp_hdr->icmp_type);
-		return (NULL);
+		obj->efd = epoll_create1 (EPOLL_CLOEXEC);
+		if (obj->efd == -1)
+		{
+			ping_set_errno (obj, errno);
+			return (-1);
+		}
 	}
 
-	recv_checksum = icmp_hdr->icmp_cksum;
-	/* This writes to buffer. */
-	icmp_hdr->icmp_cksum = 0;
-	calc_checksum = ping_icmp4_checksum (buffer, buffer_len);
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.fd = fd;
 
-	if (recv_checksum != calc_checksum)
+	if (epoll_ctl (obj->efd, EPOLL_CTL_ADD, fd, &ev) != 0)
 	{
-		dprintf ("Checksum missmatch: Got 0x%04"PRIx16", "
-				"calculated 0x%04"PRIx16"\n",
-				recv_checksum, calc_checksum);
-		return (NULL);
+		ping_set_errno (obj, errno);
+		return (-1);
 	}
+#endif /* PING_USE_EPOLL */
 
-	ident = ntohs (icmp_hdr->icmp_id);
-	seq   = ntohs (icmp_hdr->icmp_seq);
+	return (0);
+}
 
-	for (ptr = obj->table[ident % PING_TABLE_LEN];
-			ptr != NULL; ptr = ptr->table_next)
-	{
-		dprintf ("hostname = %s, ident = 0x%04x, seq = %i\n",
-				ptr->hostname, ptr->ident, ((ptr->sequence - 1) & 0xFFFF));
+static void ping_event_set (pingobj_t *obj, int fd, int readable, int writable)
+{
+	int flags = 0;
 
-		if (ptr->addrfamily != AF_INET)
-			continue;
+	if (readable)
+		flags |= PING_FD_READABLE;
+	if (writable)
+		flags |= PING_FD_WRITABLE;
 
-		if (!timerisset (ptr->timer))
-			continue;
+	if (fd == obj->fd4)
+		obj->fd4_ready |= flags;
+	else if (fd == obj->fd6)
+		obj->fd6_ready |= flags;
+}
 
-		if (ptr->ident != ident)
-			continue;
+/* ping_event_wait waits up to "timeout" for one of the sockets to become
+ * ready. "write4" and "write6" tell whether the caller wants to write to the
+ * IPv4 and IPv6 socket, respectively. Returns the number of ready sockets,
+ * zero on timeout or -1 on error. */
+static int ping_event_wait (pingobj_t *obj, struct timespec *timeout,
+		int write4, int write6)
+{
+	int timeout_ms;
+	int status;
+	int i;
 
-		if (((ptr->sequence - 1) & 0xFFFF) != seq)
-			continue;
+	if (timeout->tv_sec >= (INT_MAX / 1000) - 1)
+		timeout_ms = INT_MAX;
+	else
+		timeout_ms = (int) (1000 * timeout->tv_sec)
+			+ (int) ((timeout->tv_nsec + 999999) / 1000000);
 
-		dprintf ("Match found: hostname = %s, ident = 0x%04"PRIx16", "
-				"seq = %"PRIu16"\n",
-				ptr->hostname, ident, seq);
+#if PING_USE_EPOLL
+	struct epoll_event events[2];
 
-		break;
+	/* Edge-triggered: the sockets report writability on their own. */
+	(void) write4;
+	(void) write6;
+
+	status = epoll_wait (obj->efd, events, 2, timeout_ms);
+	if (status < 0)
+	{
+		ping_set_errno (obj, errno);
+		return (-1);
 	}
 
-	if (ptr == NULL)
+	for (i = 0; i < status; i++)
+		ping_event_set (obj, events[i].data.fd,
+				events[i].events
+				& (EPOLLIN | EPOLLERR | EPOLLHUP),
+				events[i].events & EPOLLOUT);
+/* #endif PING_USE_EPOLL */
+
+#else
+	struct pollfd fds[2];
+	nfds_t fds_num = 0;
+
+	if (obj->fd4 != -1)
 	{
-		dprintf ("No match found for ident = 0x%04"PRIx16", seq = %"PRIu16"\n",
-				ident, seq);
+		fds[fds_num].fd = obj->fd4;
+		fds[fds_num].events = POLLIN;
+		if (write4)
+			fds[fds_num].events |= POLLOUT;
+		fds[fds_num].revents = 0;
+		fds_num++;
+	}
+	if (obj->fd6 != -1)
+	{
+		fds[fds_num].fd = obj->fd6;
+		fds[fds_num].events = POLLIN;
+		if (write6)
+			fds[fds_num].events |= POLLOUT;
+		fds[fds_num].revents = 0;
+		fds_num++;
 	}
 
-	if (ptr != NULL){
-		ptr->recv_ttl = (int)     ip_hdr->ip_ttl;
-		ptr->recv_qos = (uint8_t) ip_hdr->ip_tos;
+	status = poll (fds, fds_num, timeout_ms);
+	if (status < 0)
+	{
+		ping_set_errno (obj, errno);
+		return (-1);
 	}
-	return (ptr);
+
+	for (i = 0; i < (int) fds_num; i++)
+		ping_event_set (obj, fds[i].fd,
+				fds[i].revents & (POLLIN | POLLERR | POLLHUP),
+				fds[i].revents & POLLOUT);
+#endif /* !PING_USE_EPOLL */
+
+	return (status);
+} /* int ping_event_wait */
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Batch buffers:                                                            *
+ *                                                                           *
+ * Echo requests are handed to sendmmsg(2) straight from the hosts' packet   *
+ * templates, batch_size at a time. Echo replies are read into recv_buffer   *
+ * by recvmmsg(2), which holds batch_size packets of recv_len bytes: at      *
+ * least PING_PACKET_LEN, more if the data is large.                         *
+ * The buffers are allocated on first use and freed when the batch size      *
+ * changes.                                                                  *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void ping_batch_free (pingobj_t *obj)
+{
+	free (obj->send_hosts);
+	obj->send_hosts = NULL;
+#if HAVE_SENDMMSG
+	free (obj->send_msgs);
+	obj->send_msgs = NULL;
+	free (obj->send_iov);
+	obj->send_iov = NULL;
+#endif
+	free (obj->recv_buffer);
+	obj->recv_buffer = NULL;
+	free (obj->recv_control);
+	obj->recv_control = NULL;
+	free (obj->recv_addrs);
+	obj->recv_addrs = NULL;
+#if HAVE_RECVMMSG
+	free (obj->recv_msgs);
+	obj->recv_msgs = NULL;
+	free (obj->recv_iov);
+	obj->recv_iov = NULL;
+#endif
 }
 
-#ifndef ICMP6_ECHO_REQUEST
-# ifdef ICMP6_ECHO /* AIX netinet/ip6_icmp.h */
-#  define ICMP6_ECHO_REQUEST ICMP6_ECHO
-# else
-#  define ICMP6_ECHO_REQUEST 128
-# endif
+static int ping_batch_alloc (pingobj_t *obj)
+{
+#if HAVE_SENDMMSG || HAVE_RECVMMSG
+	size_t num = (size_t) obj->batch_size;
 #endif
+	size_t recv_num = 1;
+	int failed = 0;
 
-#ifndef ICMP6_ECHO_REPLY
-# ifdef ICMP6_ECHOREPLY /* AIX netinet/ip6_icmp.h */
-#  define ICMP6_ECHO_REPLY ICMP6_ECHOREPLY
-# else
-#  define ICMP6_ECHO_REPLY 129
-# endif
+	if (obj->recv_buffer != NULL)
+		return (0);
+
+#if HAVE_SENDMMSG
+	obj->send_hosts  = calloc (num, sizeof (*obj->send_hosts));
+	obj->send_msgs   = calloc (num, sizeof (*obj->send_msgs));
+	obj->send_iov    = calloc (num * PING_PACKET_IOV_LEN,
+			sizeof (*obj->send_iov));
+	failed |= (obj->send_hosts == NULL) || (obj->send_msgs == NULL)
+		|| (obj->send_iov == NULL);
 #endif
 
-static pinghost_t *ping_receive_ipv6 (pingobj_t *obj, char *buffer,
-		size_t buffer_len)
+#if HAVE_RECVMMSG
+	recv_num = num;
+	obj->recv_msgs   = calloc (num, sizeof (*obj->recv_msgs));
+	obj->recv_iov    = calloc (num, sizeof (*obj->recv_iov));
+	failed |= (obj->recv_msgs == NULL) || (obj->recv_iov == NULL);
+#endif
+	/* Room for the largest IPv4 header and the largest reply. */
+	obj->recv_len = PING_PACKET_LEN;
+	if (obj->recv_len < 60 + ICMP_MINLEN + PING_PAYLOAD_HEADER_LEN
+			+ obj->data_max)
+		obj->recv_len = 60 + ICMP_MINLEN + PING_PAYLOAD_HEADER_LEN
+			+ obj->data_max;
+	obj->recv_buffer  = malloc (recv_num * obj->recv_len);
+	obj->recv_control = malloc (recv_num * PING_CONTROL_LEN);
+	obj->recv_addrs   = malloc (recv_num * sizeof (*obj->recv_addrs));
+	failed |= (obj->recv_buffer == NULL) || (obj->recv_control == NULL)
+		|| (obj->recv_addrs == NULL);
+
+	if (failed)
+	{
+		ping_set_errno (obj, ENOMEM);
+		ping_batch_free (obj);
+		return (-1);
+	}
+
+	return (0);
+} /* int ping_batch_alloc */
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Scheduler functions:                                                      *
+ *                                                                           *
+ * In continuous mode (see "ping_run_start") all hosts are kept in a binary  *
+ * min-heap, ordered by the time of their next event: sending the next echo  *
+ * request or giving up on the outstanding one, whichever comes first.       *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void ping_heap_swap (pingobj_t *obj, size_t a, size_t b)
 {
-	struct icmp6_hdr *icmp_hdr;
+	pinghost_t *tmp = obj->heap[a];
 
-	uint16_t ident;
-	uint16_t seq;
+	obj->heap[a] = obj->heap[b];
+	obj->heap[b] = tmp;
 
-	pinghost_t *ptr;
+	obj->heap[a]->heap_index = (int) a;
+	obj->heap[b]->heap_index = (int) b;
+}
 
-	if (buffer_len < ICMP_MINLEN)
-		return (NULL);
+static void ping_heap_up (pingobj_t *obj, size_t i)
+{
+	while (i > 0)
+	{
+		size_t parent = (i - 1) / 2;
 
-	icmp_hdr = (struct icmp6_hdr *) buffer;
-	buffer     += ICMP_MINLEN;
-	buffer_len -= ICMP_MINLEN;
+		if (ping_timespec_cmp (&obj->heap[i]->due,
+					&obj->heap[parent]->due) >= 0)
+			break;
 
-	if (icmp_hdr->icmp6_type != ICMP6_ECHO_REPLY)
+		ping_heap_swap (obj, i, parent);
+		i = parent;
+	}
+}
+
+static void ping_heap_down (pingobj_t *obj, size_t i)
+{
+	while (1)
 	{
-		dprintf ("Unexpected ICMP type: %02x\n", icmp_hdr->icmp6_type);
-		return (NULL);
+		size_t left = (2 * i) + 1;
+		size_t right = left + 1;
+		size_t min = i;
+
+		if ((left < obj->heap_len)
+				&& (ping_timespec_cmp (&obj->heap[left]->due,
+						&obj->heap[min]->due) < 0))
+			min = left;
+		if ((right < obj->heap_len)
+				&& (ping_timespec_cmp (&obj->heap[right]->due,
+						&obj->heap[min]->due) < 0))
+			min = right;
+
+		if (min == i)
+			break;
+
+		ping_heap_swap (obj, i, min);
+		i = min;
 	}
+}
 
-	if (icmp_hdr->icmp6_code != 0)
+static int ping_heap_insert (pingobj_t *obj, pinghost_t *ph)
+{
+	if (obj->heap_len >= obj->heap_size)
 	{
-		dprintf ("Unexpected ICMP code: %02x\n", icmp_hdr->icmp6_code);
-		return (NULL);
+		size_t size = (obj->heap_size == 0) ? 64 : 2 * obj->heap_size;
+		pinghost_t **tmp;
+
+		tmp = realloc (obj->heap, size * sizeof (*tmp));
+		if (tmp == NULL)
+		{
+			ping_set_errno (obj, ENOMEM);
+			return (-1);
+		}
+		obj->heap = tmp;
+		obj->heap_size = size;
 	}
 
-	ident = ntohs (icmp_hdr->icmp6_id);
-	seq   = ntohs (icmp_hdr->icmp6_seq);
+	ph->heap_index = (int) obj->heap_len;
+	obj->heap[obj->heap_len] = ph;
+	obj->heap_len++;
 
-	/* We have to iterate over all hosts, since ICMPv6 packets may
-	 * be received on any raw v6 socket. */
-	for (ptr = obj->head; ptr != NULL; ptr = ptr->next)
-	{
-		dprintf ("hostname = %s, ident = 0x%04x, seq = %i\n",
-				ptr->hostname, ptr->ident, ((ptr->sequence - 1) & 0xFFFF));
+	ping_heap_up (obj, (size_t) ph->heap_index);
 
-		if (ptr->addrfamily != AF_INET6)
-			continue;
+	return (0);
+}
 
-		if (!timerisset (ptr->timer))
-			continue;
+static void ping_heap_remove (pingobj_t *obj, pinghost_t *ph)
+{
+	size_t i;
 
-		if (ptr->ident != ident)
-			continue;
+	if (ph->heap_index < 0)
+		return;
 
-		if (((ptr->sequence - 1) & 0xFFFF) != seq)
-			continue;
+	i = (size_t) ph->heap_index;
+	ph->heap_index = -1;
 
-		dprintf ("Match found: hostname = %s, ident = 0x%04"PRIx16", "
-				"seq = %"PRIu16"\n",
-				ptr->hostname, ident, seq);
+	obj->heap_len--;
+	if (i == obj->heap_len)
+		return;
 
-		break;
-	}
+	obj->heap[i] = obj->heap[obj->heap_len];
+	obj->heap[i]->heap_index = (int) i;
 
-	if (ptr == NULL)
-	{
-		dprintf ("No match found for ident = 0x%04"PRIx16", "
-				"seq = %"PRIu16"\n",
-				ident, seq);
-	}
+	ping_heap_up (obj, i);
+	ping_heap_down (obj, (size_t) obj->heap[i]->heap_index);
+}
 
-	return (ptr);
+static void ping_heap_clear (pingobj_t *obj)
+{
+	while (obj->heap_len > 0)
+		ping_heap_remove (obj, obj->heap[obj->heap_len - 1]);
 }
 
-static int ping_receive_one (pingobj_t *obj, struct timeval *now, int addrfam)
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Host slots:                                                               *
+ *                                                                           *
+ * Each host of an object has a slot number, which determines the ident and  *
+ * sequence numbers of its echo requests. The ident is ident_base plus the   *
+ * slot number, modulo 2^16, so the first 65536 hosts have unique idents.    *
+ * The upper bits of the sequence number hold the slot number divided by     *
+ * 2^16, and only the lower PING_SEQ_BITS count the echo requests. Either    *
+ * way, a reply's ident and sequence number lead straight to its host.       *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* ping_slot_reserve makes the slot table at least "num" slots large. */
+static int ping_slot_reserve (pingobj_t *obj, size_t num)
 {
-	int fd = addrfam == AF_INET6 ? obj->fd6 : obj->fd4;
-	struct timeval diff, pkt_now = *now;
-	pinghost_t *host = NULL;
-	int recv_ttl;
-	uint8_t recv_qos;
+	size_t size;
+	pinghost_t **slots;
+	uint32_t *slots_free;
 
-	/*
-	 * Set up the receive buffer..
-	 */
-	struct msghdr msghdr;
-	struct cmsghdr *cmsg;
-	char payload_buffer[4096];
-	ssize_t payload_buffer_len;
-	char control_buffer[4096];
-	struct iovec payload_iovec;
+	if (num <= obj->slots_size)
+		return (0);
 
-	memset (&payload_iovec, 0, sizeof (payload_iovec));
-	payload_iovec.iov_base = payload_buffer;
-	payload_iovec.iov_len = sizeof (payload_buffer);
+	size = (obj->slots_size == 0) ? 64 : obj->slots_size;
+	while (size < num)
+		size *= 2;
 
-	memset (&msghdr, 0, sizeof (msghdr));
-	/* unspecified source address */
-	msghdr.msg_name = NULL;
-	msghdr.msg_namelen = 0;
-	/* output buffer vector, see readv(2) */
-	msghdr.msg_iov = &payload_iovec;
-	msghdr.msg_iovlen = 1;
-	/* output buffer for control messages */
-	msghdr.msg_control = control_buffer;
-	msghdr.msg_controllen = sizeof (control_buffer);
+	slots = realloc (obj->slots, size * sizeof (*slots));
+	if (slots == NULL)
+	{
+		ping_set_errno (obj, errno);
+		return (-1);
+	}
+	obj->slots = slots;
+
+	slots_free = realloc (obj->slots_free, size * sizeof (*slots_free));
+	if (slots_free == NULL)
+	{
+		ping_set_errno (obj, errno);
+		return (-1);
+	}
+	obj->slots_free = slots_free;
+
+	obj->slots_size = size;
+
+	return (0);
+}
+
+static int ping_slot_alloc (pingobj_t *obj, pinghost_t *ph)
+{
+	size_t slot;
+
+	if (obj->slots_free_num > 0)
+	{
+		slot = obj->slots_free[--obj->slots_free_num];
+	}
+	else
+	{
+		if (obj->slots_num >= PING_MAX_SLOTS)
+		{
+			ping_set_error (obj, "ping_host_add", "Too many hosts");
+			return (-1);
+		}
+
+		if (ping_slot_reserve (obj, obj->slots_num + 1) != 0)
+			return (-1);
+
+		slot = obj->slots_num++;
+	}
+
+	obj->slots[slot] = ph;
+	ph->slot = (uint32_t) slot;
+	ph->ident = (int) ((obj->ident_base + slot) & 0xFFFF);
+
+	return (0);
+}
+
+static void ping_slot_free (pingobj_t *obj, pinghost_t *ph)
+{
+	obj->slots[ph->slot] = NULL;
+	obj->slots_free[obj->slots_free_num++] = ph->slot;
+}
+
+/* ping_slot_lookup returns the host an echo request with "ident" and "seq"
+ * was sent to, or NULL. */
+static pinghost_t *ping_slot_lookup (pingobj_t *obj, uint16_t ident,
+		uint16_t seq)
+{
+	size_t slot = ((size_t) ((ident - obj->ident_base) & 0xFFFF))
+		| (((size_t) (seq >> PING_SEQ_BITS)) << 16);
+
+	if (slot >= obj->slots_num)
+		return (NULL);
+
+	return (obj->slots[slot]);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Probe window:                                                             *
+ *                                                                           *
+ * A host may have up to "window" echo requests outstanding. The send time   *
+ * of the request with sequence number "seq" is kept in timer[seq % window]; *
+ * an unset time means the request has been answered or given up on. Since   *
+ * sequence numbers only grow, the window holds the last "window" requests   *
+ * sent.                                                                     *
+ *                                                                           *
+ * Rounds have one request per host outstanding, so the window starts out as *
+ * the single entry "timer_one". "ping_probe_grow" makes it PING_WINDOW_LEN  *
+ * entries large once a host has more requests outstanding, which continuous *
+ * mode does when replies take longer than the interval.                     *
+ *                                                                           *
+ * The bits of "answered" tell which of the last 32 requests have been       *
+ * answered, so that a late reply to a request given up on can be told from  *
+ * a duplicate, see "ping_probe_answer".                                     *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static struct timespec *ping_probe_timer (pinghost_t *ph, int seq)
+{
+	return (ph->timer + (((unsigned int) seq) & (ph->window - 1)));
+}
+
+/* ping_probe_seq returns the ICMP sequence number of the echo request with
+ * sequence number "seq", see "ping_slot_alloc". */
+static uint16_t ping_probe_seq (pinghost_t *ph, int seq)
+{
+	return ((uint16_t) (((ph->slot >> 16) << PING_SEQ_BITS)
+				| (((unsigned int) seq) & PING_SEQ_MASK)));
+}
+
+/* ping_probe_find returns the send time of the outstanding echo request with
+ * ICMP sequence number "seq" or NULL if there is none. */
+static struct timespec *ping_probe_find (pinghost_t *ph, uint16_t seq)
+{
+	struct timespec *tv;
+
+	if ((seq >> PING_SEQ_BITS) != (ph->slot >> 16))
+		return (NULL);
+
+	if ((((unsigned int) ph->sequence - 1 - seq) & PING_SEQ_MASK)
+			>= ph->window)
+		return (NULL);
+
+	tv = ping_probe_timer (ph, seq);
+	if (!ping_timespec_isset (tv))
+		return (NULL);
+
+	return (tv);
+}
+
+/* ping_probe_oldest returns the send time of the oldest outstanding echo
+ * request of "ph" or NULL if there is none. */
+static struct timespec *ping_probe_oldest (pinghost_t *ph)
+{
+	int i;
+
+	if (ph->pending <= 0)
+		return (NULL);
+
+	for (i = (int) ph->window; i > 0; i--)
+	{
+		struct timespec *tv = ping_probe_timer (ph, ph->sequence - i);
+		if (ping_timespec_isset (tv))
+			return (tv);
+	}
+
+	return (NULL);
+}
+
+static void ping_probe_clear (pinghost_t *ph, struct timespec *tv)
+{
+	if ((tv == NULL) || !ping_timespec_isset (tv))
+		return;
+
+	ping_timespec_clear (tv);
+	ph->pending--;
+}
+
+static void ping_probe_clear_all (pinghost_t *ph)
+{
+	memset (ph->timer, 0, ph->window * sizeof (*ph->timer));
+	ph->pending = 0;
+}
+
+/* ping_probe_answer records that the echo request with ICMP sequence number
+ * "seq" has been answered. Returns -1 if it has been answered before or was
+ * sent too long ago to tell, and zero otherwise. */
+static int ping_probe_answer (pinghost_t *ph, uint16_t seq)
+{
+	unsigned int age;
+	uint32_t bit;
+
+	if ((seq >> PING_SEQ_BITS) != (ph->slot >> 16))
+		return (-1);
+
+	age = ((unsigned int) ph->sequence - 1 - seq) & PING_SEQ_MASK;
+	if (age >= 32)
+		return (-1);
+
+	bit = ((uint32_t) 1) << age;
+	if (ph->answered & bit)
+		return (-1);
+
+	ph->answered |= bit;
+	return (0);
+}
+
+/* ping_probe_grow makes the window of "ph" PING_WINDOW_LEN entries large.
+ * Returns zero on success and less than zero if the window is that large
+ * already or memory is short. */
+static int ping_probe_grow (pinghost_t *ph)
+{
+	struct timespec *timer;
+
+	if (ph->window >= PING_WINDOW_LEN)
+		return (-1);
+
+	timer = calloc (PING_WINDOW_LEN, sizeof (*timer));
+	if (timer == NULL)
+		return (-1);
+
+	/* The only request that can be outstanding is the last one sent. */
+	timer[((unsigned int) ph->sequence - 1) & (PING_WINDOW_LEN - 1)]
+		= ph->timer[0];
+
+	ph->timer = timer;
+	ph->window = PING_WINDOW_LEN;
+	return (0);
+}
+
+/* ping_probe_unsent forgets the send time of the echo request with the
+ * host's current sequence number, which could not be sent after all. */
+static void ping_probe_unsent (pinghost_t *ph)
+{
+	ping_timespec_clear (ping_probe_timer (ph, ph->sequence));
+}
+
+/* ping_probe_sent is called when the echo request with the host's current
+ * sequence number has been sent. */
+static void ping_probe_sent (pinghost_t *ph)
+{
+	ph->sequence++;
+	ph->pending++;
+	ph->answered <<= 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Address index:                                                            *
+ *                                                                           *
+ * Ping sockets (PING_OPT_DGRAM) replace the ident of echo requests by their *
+ * own, so replies are matched on the source address and sequence number     *
+ * instead. "addrs" is a hash table of all hosts by address, chained through *
+ * addr_next, with at least as many buckets as there are slots.              *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t ping_addr_hash (const struct sockaddr *sa)
+{
+	const unsigned char *ptr;
+	size_t len;
+	uint32_t hash = 2166136261U;
+
+	if (sa->sa_family == AF_INET)
+	{
+		ptr = (const unsigned char *)
+			&((const struct sockaddr_in *) sa)->sin_addr;
+		len = sizeof (struct in_addr);
+	}
+	else if (sa->sa_family == AF_INET6)
+	{
+		ptr = (const unsigned char *)
+			&((const struct sockaddr_in6 *) sa)->sin6_addr;
+		len = sizeof (struct in6_addr);
+	}
+	else
+	{
+		return (0);
+	}
+
+	/* FNV-1a */
+	while (len-- > 0)
+	{
+		hash ^= *ptr++;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+static int ping_addr_equal (const struct sockaddr *a,
+		const struct sockaddr *b)
+{
+	const void *addr_a;
+	const void *addr_b;
+	size_t len;
+
+	if (a->sa_family != b->sa_family)
+		return (0);
+
+	if (a->sa_family == AF_INET)
+	{
+		addr_a = &((const struct sockaddr_in *) a)->sin_addr;
+		addr_b = &((const struct sockaddr_in *) b)->sin_addr;
+		len = sizeof (struct in_addr);
+	}
+	else if (a->sa_family == AF_INET6)
+	{
+		addr_a = &((const struct sockaddr_in6 *) a)->sin6_addr;
+		addr_b = &((const struct sockaddr_in6 *) b)->sin6_addr;
+		len = sizeof (struct in6_addr);
+	}
+	else
+	{
+		return (0);
+	}
+
+	return (memcmp (addr_a, addr_b, len) == 0);
+}
+
+/* ping_addr_resize makes the table at least "num" buckets large. */
+static int ping_addr_resize (pingobj_t *obj, size_t num)
+{
+	size_t size, bucket, i;
+	pinghost_t **addrs;
+
+	if (num <= obj->addrs_size)
+		return (0);
+
+	size = (obj->addrs_size == 0) ? 64 : obj->addrs_size;
+	while (size < num)
+		size *= 2;
+
+	addrs = calloc (size, sizeof (*addrs));
+	if (addrs == NULL)
+	{
+		ping_set_errno (obj, errno);
+		return (-1);
+	}
+
+	for (i = 0; i < obj->addrs_size; i++)
+	{
+		while (obj->addrs[i] != NULL)
+		{
+			pinghost_t *next = obj->addrs[i]->addr_next;
+
+			bucket = ping_addr_hash (&obj->addrs[i]->addr.sa)
+				& (size - 1);
+			obj->addrs[i]->addr_next = addrs[bucket];
+			addrs[bucket] = obj->addrs[i];
+
+			obj->addrs[i] = next;
+		}
+	}
+
+	free (obj->addrs);
+	obj->addrs = addrs;
+	obj->addrs_size = size;
+
+	return (0);
+}
+
+static int ping_addr_add (pingobj_t *obj, pinghost_t *ph)
+{
+	size_t bucket;
+
+	if (ping_addr_resize (obj, obj->slots_num + 1) != 0)
+		return (-1);
+
+	bucket = ping_addr_hash (&ph->addr.sa) & (obj->addrs_size - 1);
+	ph->addr_next = obj->addrs[bucket];
+	obj->addrs[bucket] = ph;
+
+	return (0);
+}
+
+static void ping_addr_remove (pingobj_t *obj, pinghost_t *ph)
+{
+	pinghost_t **ptr;
+
+	if (obj->addrs_size == 0)
+		return;
+
+	ptr = obj->addrs
+		+ (ping_addr_hash (&ph->addr.sa) & (obj->addrs_size - 1));
+	while ((*ptr != NULL) && (*ptr != ph))
+		ptr = &(*ptr)->addr_next;
+
+	if (*ptr != NULL)
+		*ptr = ph->addr_next;
+	ph->addr_next = NULL;
+}
+
+/* ping_addr_lookup returns the host with address "from" that has an
+ * outstanding echo request with ICMP sequence number "seq", or NULL. */
+static pinghost_t *ping_addr_lookup (pingobj_t *obj,
+		const struct sockaddr *from, uint16_t seq)
+{
+	pinghost_t *ph;
+
+	if (obj->addrs_size == 0)
+		return (NULL);
+
+	for (ph = obj->addrs[ping_addr_hash (from) & (obj->addrs_size - 1)];
+			ph != NULL;
+			ph = ph->addr_next)
+		if (ping_addr_equal (&ph->addr.sa, from)
+				&& (ping_probe_find (ph, seq) != NULL))
+			return (ph);
+
+	return (NULL);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Host names:                                                               *
+ *                                                                           *
+ * "names" is a hash table of all hosts by name (see "ping_host_name"),      *
+ * chained through name_next, with at least as many                          *
+ * buckets as there are hosts. Names compare case-insensitively, as with     *
+ * strcasecmp(3), so the hash folds ASCII upper case letters. Together with  *
+ * the list's tail pointer and host count, adding, finding and removing a    *
+ * host take constant time.                                                  *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* ping_host_ext returns the extension of "ph", allocating it on first use,
+ * or NULL if memory is short. Hosts added by name have one from the start,
+ * hosts added by "ping_host_add_range" once they record an RTT. */
+static struct pinghostext *ping_host_ext (pinghost_t *ph)
+{
+	if (ph->ext == NULL)
+		ph->ext = calloc (1, sizeof (*ph->ext));
+
+	return (ph->ext);
+}
+
+/* ping_host_hostname returns the name the address of "ph" resolved to, or
+ * NULL for hosts added by "ping_host_add_range". */
+static const char *ping_host_hostname (const pinghost_t *ph)
+{
+	if (ph->ext == NULL)
+		return (NULL);
+
+	return (ph->ext->hostname);
+}
+
+/* ping_host_name returns the name of "ph": the name passed to
+ * "ping_host_add", or its address formatted into "buffer" for hosts added
+ * by "ping_host_add_range". */
+static const char *ping_host_name (const pinghost_t *ph, char *buffer,
+		size_t buffer_size)
+{
+	const void *src;
+
+	if ((ph->ext != NULL) && (ph->ext->username != NULL))
+		return (ph->ext->username);
+
+	if (ph->addrfamily == AF_INET6)
+		src = &ph->addr.sin6.sin6_addr;
+	else
+		src = &ph->addr.sin.sin_addr;
+
+	if (inet_ntop (ph->addrfamily, src, buffer, (socklen_t) buffer_size)
+			== NULL)
+		buffer[0] = 0;
+
+	return (buffer);
+}
+
+static uint32_t ping_name_hash (const char *name)
+{
+	const unsigned char *ptr = (const unsigned char *) name;
+	uint32_t hash = 2166136261U;
+
+	/* FNV-1a */
+	for (; *ptr != 0; ptr++)
+	{
+		unsigned char c = *ptr;
+
+		if ((c >= 'A') && (c <= 'Z'))
+			c += 'a' - 'A';
+		hash ^= c;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+/* ping_name_resize makes the table at least "size" buckets large. */
+static int ping_name_resize (pingobj_t *obj, size_t size)
+{
+	pinghost_t **names;
+	size_t new_size;
+	size_t i;
+
+	if (size <= obj->names_size)
+		return (0);
+
+	new_size = (obj->names_size == 0) ? 64 : obj->names_size;
+	while (new_size < size)
+		new_size *= 2;
+
+	names = calloc (new_size, sizeof (*names));
+	if (names == NULL)
+	{
+		ping_set_errno (obj, errno);
+		return (-1);
+	}
+
+	for (i = 0; i < obj->names_size; i++)
+	{
+		while (obj->names[i] != NULL)
+		{
+			pinghost_t *ph = obj->names[i];
+			size_t bucket = ph->name_hash & (new_size - 1);
+
+			obj->names[i] = ph->name_next;
+			ph->name_next = names[bucket];
+			names[bucket] = ph;
+		}
+	}
+
+	free (obj->names);
+	obj->names = names;
+	obj->names_size = new_size;
+
+	return (0);
+}
+
+static int ping_name_add (pingobj_t *obj, pinghost_t *ph)
+{
+	char buffer[INET6_ADDRSTRLEN];
+	size_t bucket;
+
+	if (ping_name_resize (obj, obj->hosts_num + 1) != 0)
+		return (-1);
+
+	ph->name_hash = ping_name_hash (ping_host_name (ph, buffer,
+				sizeof (buffer)));
+	bucket = ph->name_hash & (obj->names_size - 1);
+	ph->name_next = obj->names[bucket];
+	obj->names[bucket] = ph;
+
+	return (0);
+}
+
+static void ping_name_remove (pingobj_t *obj, pinghost_t *ph)
+{
+	pinghost_t **ptr;
+
+	if (obj->names_size == 0)
+		return;
+
+	ptr = obj->names + (ph->name_hash & (obj->names_size - 1));
+	while ((*ptr != NULL) && (*ptr != ph))
+		ptr = &(*ptr)->name_next;
+
+	if (*ptr != NULL)
+		*ptr = ph->name_next;
+	ph->name_next = NULL;
+}
+
+/* ping_name_lookup returns the host added as "name", or NULL. */
+static pinghost_t *ping_name_lookup (pingobj_t *obj, const char *name)
+{
+	uint32_t hash;
+	pinghost_t *ph;
+
+	if (obj->names_size == 0)
+		return (NULL);
+
+	hash = ping_name_hash (name);
+	for (ph = obj->names[hash & (obj->names_size - 1)];
+			ph != NULL;
+			ph = ph->name_next)
+	{
+		char buf[INET6_ADDRSTRLEN];
+
+		if (ph->name_hash != hash)
+			continue;
+
+		if (strcasecmp (ping_host_name (ph, buf, sizeof (buf)),
+					name) == 0)
+			return (ph);
+	}
+
+	return (NULL);
+}
+
+/* ping_name_next returns the next host with the same name as "ph", or NULL.
+ * Only PING_OPT_ALL_ADDRESSES adds several hosts of one name. */
+static pinghost_t *ping_name_next (pinghost_t *ph)
+{
+	char name[INET6_ADDRSTRLEN];
+	const char *ph_name = ping_host_name (ph, name, sizeof (name));
+	pinghost_t *next;
+
+	for (next = ph->name_next; next != NULL; next = next->name_next)
+	{
+		char buf[INET6_ADDRSTRLEN];
+
+		if (next->name_hash != ph->name_hash)
+			continue;
+
+		if (strcasecmp (ping_host_name (next, buf, sizeof (buf)),
+					ph_name) == 0)
+			return (next);
+	}
+
+	return (NULL);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Payload header:                                                           *
+ *                                                                           *
+ * With PING_OPT_PAYLOAD_HEADER, the data of each echo request starts with   *
+ * the object's cookie, the host's slot number and the send time in          *
+ * nanoseconds, in network byte order. The echo reply carries them back, so  *
+ * the host is found and the round-trip time computed from the reply alone.  *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void ping_payload_put32 (char *buf, uint32_t value)
+{
+	value = htonl (value);
+	memcpy (buf, &value, sizeof (value));
+}
+
+static uint32_t ping_payload_get32 (const char *buf)
+{
+	uint32_t value;
+
+	memcpy (&value, buf, sizeof (value));
+	return (ntohl (value));
+}
+
+/* ping_payload_stamp writes the send time into the header at "buf". */
+static void ping_payload_stamp (struct timespec *sent, char *buf)
+{
+	uint64_t ns = (uint64_t) ping_timespec_ns (sent);
+
+	ping_payload_put32 (buf + PING_PAYLOAD_STAMP_OFFSET,
+			(uint32_t) (ns >> 32));
+	ping_payload_put32 (buf + PING_PAYLOAD_STAMP_OFFSET + 4,
+			(uint32_t) ns);
+}
+
+static void ping_payload_write (pingobj_t *obj, pinghost_t *ph,
+		struct timespec *sent, char *buf)
+{
+	ping_payload_put32 (buf, obj->cookie);
+	ping_payload_put32 (buf + 4, ph->slot);
+	ping_payload_stamp (sent, buf);
+}
+
+/* ping_payload_read checks the header at the start of an echo reply's data.
+ * If it was written by this object, the send time is stored in "sent" and
+ * the host is returned. Otherwise, NULL is returned. */
+static pinghost_t *ping_payload_read (pingobj_t *obj, const char *buf,
+		size_t buf_len, struct timespec *sent)
+{
+	uint32_t slot;
+	uint64_t ns;
+
+	if (buf_len < PING_PAYLOAD_HEADER_LEN)
+		return (NULL);
+
+	if (ping_payload_get32 (buf) != obj->cookie)
+	{
+		dprintf ("Cookie mismatch\n");
+		return (NULL);
+	}
+
+	slot = ping_payload_get32 (buf + 4);
+	if (slot >= obj->slots_num)
+		return (NULL);
+
+	buf += PING_PAYLOAD_STAMP_OFFSET;
+	ns = (((uint64_t) ping_payload_get32 (buf)) << 32)
+		| ((uint64_t) ping_payload_get32 (buf + 4));
+	sent->tv_sec  = (time_t) (ns / 1000000000);
+	sent->tv_nsec = (long) (ns % 1000000000);
+
+	return (obj->slots[slot]);
+}
+
+/* ping_host_timeout returns the time to wait for a reply from "ph", in
+ * seconds. With PING_OPT_TIMEOUT_ADAPTIVE this is derived from the replies
+ * received so far like TCP's retransmission timeout (RFC 6298), i.e.
+ * SRTT + 4 * RTTVAR, bounded by timeout_min and timeout. */
+static double ping_host_timeout (pingobj_t *obj, pinghost_t *ph)
+{
+	double timeout;
+
+	if (!obj->timeout_adaptive || (ph->srtt < 0.0))
+		return (obj->timeout);
+
+	timeout = ph->srtt + (4.0 * ph->rttvar);
+	if (timeout < obj->timeout_min)
+		timeout = obj->timeout_min;
+	if (timeout > obj->timeout)
+		timeout = obj->timeout;
+
+	return (timeout);
+}
+
+static void ping_host_update_rtt (pinghost_t *ph, double rtt)
+{
+	double err;
+
+	if (ph->srtt < 0.0)
+	{
+		ph->srtt = rtt;
+		ph->rttvar = rtt / 2.0;
+		return;
+	}
+
+	err = ph->srtt - rtt;
+	if (err < 0.0)
+		err = -err;
+
+	ph->rttvar = (0.75 * ph->rttvar) + (0.25 * err);
+	ph->srtt = (0.875 * ph->srtt) + (0.125 * rtt);
+}
+
+/* ping_host_record_rtt adds the round-trip time of a reply, in milliseconds,
+ * to the host's history and smoothed RTT. */
+static void ping_host_record_rtt (pinghost_t *ph, double latency)
+{
+	struct pinghostext *ext = ping_host_ext (ph);
+
+	/* Without memory for the history, only the smoothed RTT is kept. */
+	if (ext != NULL)
+	{
+		ext->rtt_history[ext->rtt_history_num % PING_RTT_HISTORY_LEN]
+			= latency;
+		ext->rtt_history_num++;
+	}
+
+	ping_host_update_rtt (ph, latency / 1000.0);
+}
+
+/* ping_host_deadline returns the time until which a reply to the echo
+ * request of "ph" sent at "sent" is accepted. */
+static void ping_host_deadline (pingobj_t *obj, pinghost_t *ph,
+		struct timespec *sent, struct timespec *deadline)
+{
+	struct timespec timeout;
+
+	ping_timespec_set (&timeout, ping_host_timeout (obj, ph));
+	ping_timespec_add (sent, &timeout, deadline);
+}
+
+/* ping_host_schedule updates the time of the host's next event and its
+ * position in the heap. */
+static void ping_host_schedule (pingobj_t *obj, pinghost_t *ph)
+{
+	struct timespec *sent = ping_probe_oldest (ph);
+
+	ph->due = ph->next_send;
+
+	if (sent != NULL)
+	{
+		struct timespec deadline;
+
+		ping_host_deadline (obj, ph, sent, &deadline);
+		if (ping_timespec_cmp (&deadline, &ph->due) < 0)
+			ph->due = deadline;
+	}
+
+	if (ph->heap_index < 0)
+		return;
+
+	ping_heap_up (obj, (size_t) ph->heap_index);
+	ping_heap_down (obj, (size_t) ph->heap_index);
+}
+
+/* ping_host_sent is called when an echo request has been sent during a
+ * round. With adaptive timeouts, the host is put into the heap so it can be
+ * given up on at its own deadline. */
+static void ping_host_sent (pingobj_t *obj, pinghost_t *ph)
+{
+	if (!obj->round_active || !obj->timeout_adaptive)
+		return;
+
+	ping_host_deadline (obj, ph, ping_probe_timer (ph, ph->sequence - 1),
+			&ph->due);
+	ping_heap_insert (obj, ph);
+}
+
+/* ping_host_notify calls the callback for "ph". The callback may remove
+ * hosts, "ph" included; their records stay valid until "ping_host_reap" is
+ * called. Returns -1 if "ph" has been removed and zero otherwise. */
+static int ping_host_notify (pingobj_t *obj, pinghost_t *ph)
+{
+	if (obj->callback == NULL)
+		return (0);
+
+	obj->callback_active++;
+	(*obj->callback) (obj, ph, obj->callback_arg);
+	obj->callback_active--;
+
+	return (ph->removed ? -1 : 0);
+}
+
+/* ping_host_done is called in continuous mode when an outstanding echo
+ * request of "ph" has been answered or given up on. */
+static void ping_host_done (pingobj_t *obj, pinghost_t *ph)
+{
+	if (ping_host_notify (obj, ph) == 0)
+		ping_host_schedule (obj, ph);
+}
+
+/* ping_checksum_add adds "len" bytes at "buf" to the one's complement sum
+ * "sum", see RFC 1071. Since the sum doesn't depend on how the 16 bit words
+ * are grouped, eight bytes are added at a time: their two 32 bit halves go
+ * into a 64 bit accumulator, which cannot overflow for any packet size. The
+ * result is folded by "ping_checksum_fold". */
+static uint64_t ping_checksum_add (uint64_t sum, const char *buf, size_t len)
+{
+	uint64_t word64;
+	uint32_t word32;
+	uint16_t word16;
+
+	for (; len >= 32; buf += 32, len -= 32)
+	{
+		uint64_t w[4];
+
+		memcpy (w, buf, sizeof (w));
+		sum += (w[0] & 0xFFFFFFFF) + (w[0] >> 32)
+			+ (w[1] & 0xFFFFFFFF) + (w[1] >> 32)
+			+ (w[2] & 0xFFFFFFFF) + (w[2] >> 32)
+			+ (w[3] & 0xFFFFFFFF) + (w[3] >> 32);
+	}
+
+	for (; len >= 8; buf += 8, len -= 8)
+	{
+		memcpy (&word64, buf, sizeof (word64));
+		sum += (word64 & 0xFFFFFFFF) + (word64 >> 32);
+	}
+
+	if (len >= 4)
+	{
+		memcpy (&word32, buf, sizeof (word32));
+		sum += word32;
+		buf += 4;
+		len -= 4;
+	}
+
+	if (len >= 2)
+	{
+		memcpy (&word16, buf, sizeof (word16));
+		sum += word16;
+		buf += 2;
+		len -= 2;
+	}
+
+	if (len == 1)
+	{
+		word16 = 0;
+		*(char *) &word16 = *buf;
+		sum += word16;
+	}
+
+	return (sum);
+}
+
+static uint16_t ping_checksum_fold (uint64_t sum)
+{
+	/* Do this twice per step to get all possible carries.. */
+	sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+	sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+
+	return ((uint16_t) ~sum);
+}
+
+static uint16_t ping_icmp4_checksum (char *buf, size_t len)
+{
+	return (ping_checksum_fold (ping_checksum_add (0, buf, len)));
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Echo request data:                                                        *
+ *                                                                           *
+ * The data set with PING_OPT_DATA or PING_OPT_DATA_BINARY is kept once, in  *
+ * a reference counted "struct pingdata", and shared by all hosts added      *
+ * while it was the object's data. Its checksum sum is calculated once, too, *
+ * see "ping_packet_build".                                                  *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static struct pingdata *ping_data_new (const void *data, size_t size)
+{
+	struct pingdata *pd;
+
+	/* One more byte to terminate string data, see PING_INFO_DATA. */
+	pd = malloc (sizeof (*pd) + size + 1);
+	if (pd == NULL)
+		return (NULL);
+
+	pd->refs = 1;
+	pd->size = size;
+	if (size > 0)
+		memcpy (pd->data, data, size);
+	pd->data[size] = 0;
+	pd->sum  = ping_checksum_add (0, pd->data, size);
+
+	return (pd);
+}
+
+static struct pingdata *ping_data_ref (struct pingdata *pd)
+{
+	pd->refs++;
+	return (pd);
+}
+
+static void ping_data_unref (struct pingdata *pd)
+{
+	if ((pd == NULL) || (--pd->refs > 0))
+		return;
+
+	free (pd);
+}
+
+/* ping_data_limit returns the most data an echo request can carry, less
+ * the payload header if "payload_header" is set. */
+static size_t ping_data_limit (int payload_header)
+{
+	return (PING_MAX_DATA_SIZE
+			- (payload_header ? PING_PAYLOAD_HEADER_LEN : 0));
+}
+
+/* ping_data_fits returns non-zero if the object's data, and that of all
+ * hosts, is at most "limit" bytes long. */
+static int ping_data_fits (pingobj_t *obj, size_t limit)
+{
+	pinghost_t *ph;
+
+	if ((obj->data != NULL) && (obj->data->size > limit))
+		return (0);
+
+	for (ph = obj->head; ph != NULL; ph = ph->next)
+		if (ph->data->size > limit)
+			return (0);
+
+	return (1);
+}
+
+/* ping_set_data makes "size" bytes at "data" the data of hosts added from
+ * now on. */
+static int ping_set_data (pingobj_t *obj, const void *data, size_t size)
+{
+	struct pingdata *pd;
+
+	if (size > ping_data_limit (obj->payload_header))
+	{
+		ping_set_error (obj, "ping_setopt", "Data too large");
+		return (-1);
+	}
+
+	pd = ping_data_new (data, size);
+	if (pd == NULL)
+	{
+		ping_set_errno (obj, errno);
+		return (-1);
+	}
+
+	ping_data_unref (obj->data);
+	obj->data = pd;
+
+	/* The receive buffers must hold the largest reply. They are
+	 * reallocated on the next send. */
+	if (size > obj->data_max)
+	{
+		obj->data_max = size;
+		ping_batch_free (obj);
+	}
+
+	return (0);
+}
+
+/* ping_receive_host returns the host an echo reply of address family
+ * "addrfam" with "ident" and "seq" from "from" belongs to, or NULL. "data" is
+ * the reply's data. With a payload header, replies to requests that have been
+ * given up on already are returned, too, and the send time is stored in
+ * "ret_sent". */
+static pinghost_t *ping_receive_host (pingobj_t *obj, int addrfam,
+		uint16_t ident, uint16_t seq, struct sockaddr_storage *from,
+		char *data, size_t data_len, struct timespec *ret_sent)
+{
+	pinghost_t *ptr;
+
+	ping_timespec_clear (ret_sent);
+	if (obj->payload_header)
+		ptr = ping_payload_read (obj, data, data_len, ret_sent);
+	else if (obj->dgram)
+		ptr = ping_addr_lookup (obj, (struct sockaddr *) from, seq);
+	else
+		ptr = ping_slot_lookup (obj, ident, seq);
+
+	/* Ping sockets use their own ident, which is all they receive. */
+	if ((ptr != NULL) && ((ptr->addrfamily != addrfam)
+				|| (!obj->dgram && (ptr->ident != ident))))
+		ptr = NULL;
+	if ((ptr != NULL) && !ping_timespec_isset (ret_sent)
+			&& (ping_probe_find (ptr, seq) == NULL))
+		ptr = NULL;
+
+	return (ptr);
+}
+
+static pinghost_t *ping_receive_ipv4 (pingobj_t *obj, char *buffer,
+		size_t buffer_len, struct sockaddr_storage *from,
+		uint16_t *ret_seq, struct timespec *ret_sent)
+{
+	struct ip *ip_hdr = NULL;
+	struct icmp *icmp_hdr;
+
+	uint16_t ident;
+	uint16_t seq;
+
+	pinghost_t *ptr;
+
+	/* Ping sockets return the ICMP message only, after the kernel has
+	 * verified its checksum. */
+	if (!obj->dgram)
+	{
+		size_t ip_hdr_len;
+
+		if (buffer_len < sizeof (struct ip))
+			return (NULL);
+
+		ip_hdr     = (struct ip *) buffer;
+		ip_hdr_len = ip_hdr->ip_hl << 2;
+
+		if (buffer_len < ip_hdr_len)
+			return (NULL);
+
+		buffer     += ip_hdr_len;
+		buffer_len -= ip_hdr_len;
+	}
+
+	if (buffer_len < ICMP_MINLEN)
+		return (NULL);
+
+	icmp_hdr = (struct icmp *) buffer;
+	if (icmp_hdr->icmp_type != ICMP_ECHOREPLY)
+	{
+		dprintf ("Unexpected ICMP type: %"PRIu8"\n", icmp_hdr->icmp_type);
+		return (NULL);
+	}
+
+	/* Summed up including the checksum field, a valid message yields
+	 * zero. */
+	if (!obj->dgram && !obj->skip_checksum
+			&& (ping_icmp4_checksum (buffer, buffer_len) != 0))
+	{
+		dprintf ("Checksum missmatch: Got 0x%04"PRIx16"\n",
+				icmp_hdr->icmp_cksum);
+		return (NULL);
+	}
+
+	ident = ntohs (icmp_hdr->icmp_id);
+	seq   = ntohs (icmp_hdr->icmp_seq);
+
+	ptr = ping_receive_host (obj, AF_INET, ident, seq, from,
+			buffer + ICMP_MINLEN, buffer_len - ICMP_MINLEN,
+			ret_sent);
+
+	if (ptr != NULL)
+	{
+		dprintf ("Match found: hostname = %s, ident = 0x%04"PRIx16", "
+				"seq = %"PRIu16"\n",
+				ping_host_hostname (ptr), ident, seq);
+	}
+	else
+	{
+		dprintf ("No match found for ident = 0x%04"PRIx16", seq = %"PRIu16"\n",
+				ident, seq);
+	}
+
+	if ((ptr != NULL) && (ip_hdr != NULL)){
+		ptr->recv_ttl = (int)     ip_hdr->ip_ttl;
+		ptr->recv_qos = (uint8_t) ip_hdr->ip_tos;
+	}
+	*ret_seq = seq;
+	return (ptr);
+}
+
+#ifndef ICMP6_ECHO_REQUEST
+# ifdef ICMP6_ECHO /* AIX netinet/ip6_icmp.h */
+#  define ICMP6_ECHO_REQUEST ICMP6_ECHO
+# else
+#  define ICMP6_ECHO_REQUEST 128
+# endif
+#endif
+
+#ifndef ICMP6_ECHO_REPLY
+# ifdef ICMP6_ECHOREPLY /* AIX netinet/ip6_icmp.h */
+#  define ICMP6_ECHO_REPLY ICMP6_ECHOREPLY
+# else
+#  define ICMP6_ECHO_REPLY 129
+# endif
+#endif
+
+static pinghost_t *ping_receive_ipv6 (pingobj_t *obj, char *buffer,
+		size_t buffer_len, struct sockaddr_storage *from,
+		uint16_t *ret_seq, struct timespec *ret_sent)
+{
+	struct icmp6_hdr *icmp_hdr;
+
+	uint16_t ident;
+	uint16_t seq;
+
+	pinghost_t *ptr;
+
+	if (buffer_len < ICMP_MINLEN)
+		return (NULL);
+
+	icmp_hdr = (struct icmp6_hdr *) buffer;
+	buffer     += ICMP_MINLEN;
+	buffer_len -= ICMP_MINLEN;
+
+	if (icmp_hdr->icmp6_type != ICMP6_ECHO_REPLY)
+	{
+		dprintf ("Unexpected ICMP type: %02x\n", icmp_hdr->icmp6_type);
+		return (NULL);
+	}
+
+	if (icmp_hdr->icmp6_code != 0)
+	{
+		dprintf ("Unexpected ICMP code: %02x\n", icmp_hdr->icmp6_code);
+		return (NULL);
+	}
+
+	ident = ntohs (icmp_hdr->icmp6_id);
+	seq   = ntohs (icmp_hdr->icmp6_seq);
+	*ret_seq = seq;
+
+	/* ICMPv6 replies to other processes are received on our raw socket,
+	 * too. The ident and sequence number lead straight to the host or
+	 * tell that the reply isn't ours; see "ping_slot_alloc". */
+	ptr = ping_receive_host (obj, AF_INET6, ident, seq, from,
+			buffer, buffer_len, ret_sent);
+
+	if (ptr != NULL)
+	{
+		dprintf ("Match found: hostname = %s, ident = 0x%04"PRIx16", "
+				"seq = %"PRIu16"\n",
+				ping_host_hostname (ptr), ident, seq);
+	}
+	else
+	{
+		dprintf ("No match found for ident = 0x%04"PRIx16", "
+				"seq = %"PRIu16"\n",
+				ident, seq);
+	}
+
+	return (ptr);
+}
+
+/* ping_receive_one handles one datagram read from the socket of address
+ * family "addrfam": "msghdr" describes the payload of "payload_buffer_len"
+ * bytes and the control messages. "now" is used as the time of arrival unless
+ * the kernel provides a timestamp, which is converted using "offset" (see
+ * "ping_clock_offset") unless that is NULL. Returns zero if the datagram is an
+ * echo reply to one of our hosts and -1 otherwise. */
+static int ping_receive_one (pingobj_t *obj, struct msghdr *msghdr,
+		size_t payload_buffer_len, struct timespec *now,
+		struct timespec *offset, int addrfam)
+{
+	char *payload_buffer = msghdr->msg_iov[0].iov_base;
+	struct timespec diff, pkt_now = *now;
+	struct timespec *sent;
+	struct timespec stamp;
+	pinghost_t *host = NULL;
+	uint16_t seq = 0;
+	int recv_ttl;
+	uint8_t recv_qos;
+	struct cmsghdr *cmsg;
+
+	dprintf ("Read %zu bytes\n", payload_buffer_len);
+
+	/* Iterate over all auxiliary data in msghdr */
+	recv_ttl = -1;
+	recv_qos = 0;
+	for (cmsg = CMSG_FIRSTHDR (msghdr); /* {{{ */
+			cmsg != NULL;
+			cmsg = CMSG_NXTHDR (msghdr, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET)
+		{
+#ifdef PING_SO_TIMESTAMP
+			if ((cmsg->cmsg_type == PING_SO_TIMESTAMP)
+					&& (offset != NULL))
+			{
+				struct timespec kernel;
+# ifdef SO_TIMESTAMPNS
+				memcpy (&kernel, CMSG_DATA (cmsg),
+						sizeof (kernel));
+# else
+				struct timeval tv;
+
+				memcpy (&tv, CMSG_DATA (cmsg), sizeof (tv));
+				kernel.tv_sec  = tv.tv_sec;
+				kernel.tv_nsec = 1000 * (long) tv.tv_usec;
+# endif
+				/* The kernel's time is CLOCK_REALTIME. */
+				if ((ping_timespec_sub (&kernel, offset,
+								&pkt_now) != 0)
+						|| (ping_timespec_cmp (&pkt_now,
+								now) > 0))
+					pkt_now = *now;
+			}
+#endif /* PING_SO_TIMESTAMP */
+		}
+		else if (addrfam == AF_INET) /* {{{ */
+		{
+			if (cmsg->cmsg_level != IPPROTO_IP)
+				continue;
+
+			if (cmsg->cmsg_type == IP_TOS)
+			{
+				memcpy (&recv_qos, CMSG_DATA (cmsg),
+						sizeof (recv_qos));
+				dprintf ("TOSv4 = 0x%02"PRIx8";\n", recv_qos);
+			} else
+			if (cmsg->cmsg_type == IP_TTL)
+			{
+				memcpy (&recv_ttl, CMSG_DATA (cmsg),
+						sizeof (recv_ttl));
+				dprintf ("TTLv4 = %i;\n", recv_ttl);
+			}
+			else
+			{
+				dprintf ("Not handling option %i.\n",
+						cmsg->cmsg_type);
+			}
+		} /* }}} */
+		else if (addrfam == AF_INET6) /* {{{ */
+		{
+			if (cmsg->cmsg_level != IPPROTO_IPV6)
+				continue;
+
+			if (cmsg->cmsg_type == IPV6_TCLASS)
+			{
+				memcpy (&recv_qos, CMSG_DATA (cmsg),
+						sizeof (recv_qos));
+				dprintf ("TOSv6 = 0x%02"PRIx8";\n", recv_qos);
+			} else
+#ifdef IPV6_HOPLIMIT
+			if (cmsg->cmsg_type == IPV6_HOPLIMIT)
+			{
+				memcpy (&recv_ttl, CMSG_DATA (cmsg),
+						sizeof (recv_ttl));
+				dprintf ("TTLv6 = %i;\n", recv_ttl);
+			}
+			else
+#endif
+#ifdef IPV6_UNICAST_HOPS
+			if (cmsg->cmsg_type == IPV6_UNICAST_HOPS)
+			{
+				memcpy (&recv_ttl, CMSG_DATA (cmsg),
+						sizeof (recv_ttl));
+				dprintf ("TTLv6 = %i;\n", recv_ttl);
+			}
+			else
+#endif
+#ifdef IPV6_MULTICAST_HOPS
+			if (cmsg->cmsg_type == IPV6_MULTICAST_HOPS)
+			{
+				memcpy (&recv_ttl, CMSG_DATA (cmsg),
+						sizeof (recv_ttl));
+				dprintf ("TTLv6 = %i;\n", recv_ttl);
+			}
+			else
+#endif
+			{
+				dprintf ("Not handling option %i.\n",
+						cmsg->cmsg_type);
+			}
+		} /* }}} */
+		else
+		{
+			dprintf ("Don't know how to handle "
+					"unknown protocol %i.\n",
+					cmsg->cmsg_level);
+		}
+	} /* }}} for (cmsg) */
+
+	if (addrfam == AF_INET)
+	{
+		host = ping_receive_ipv4 (obj, payload_buffer,
+				payload_buffer_len, msghdr->msg_name,
+				&seq, &stamp);
+		if (host == NULL)
+			return (-1);
+	}
+	else if (addrfam == AF_INET6)
+	{
+		host = ping_receive_ipv6 (obj, payload_buffer,
+				payload_buffer_len, msghdr->msg_name,
+				&seq, &stamp);
+		if (host == NULL)
+			return (-1);
+	}
+	else
+	{
+		dprintf ("ping_receive_one: Unknown address family %i.\n",
+				addrfam);
+		return (-1);
+	}
+
+	sent = ping_probe_find (host, seq);
+	if (sent == NULL)
+	{
+		/* A late reply to a request that has been given up on. The
+		 * payload header still tells its round-trip time. */
+		if (ping_probe_answer (host, seq) != 0)
+		{
+			dprintf ("Duplicate reply from %s\n",
+					ping_host_hostname (host));
+			return (-1);
+		}
+		dprintf ("Late reply from %s\n", ping_host_hostname (host));
+		if (ping_timespec_sub (&pkt_now, &stamp, &diff) == 0)
+			ping_host_record_rtt (host,
+					ping_timespec_ns (&diff) / 1000000.0);
+		return (-1);
+	}
+
+	dprintf ("rcvd: %12i.%09li\n",
+			(int) pkt_now.tv_sec,
+			(long) pkt_now.tv_nsec);
+	dprintf ("sent: %12i.%09li\n",
+			(int) sent->tv_sec,
+			(long) sent->tv_nsec);
+
+	if (ping_timespec_sub (&pkt_now, sent, &diff) < 0)
+	{
+		ping_probe_clear (host, sent);
+		return (-1);
+	}
+
+	dprintf ("diff: %12i.%09li\n",
+			(int) diff.tv_sec,
+			(long) diff.tv_nsec);
+
+	if (recv_ttl >= 0)
+		host->recv_ttl = recv_ttl;
+	host->recv_qos = recv_qos;
+
+	host->latency_ns = ping_timespec_ns (&diff);
+	host->latency = ((double) host->latency_ns) / 1000000.0;
+	ping_host_record_rtt (host, host->latency);
+
+	ping_probe_clear (host, sent);
+	ping_probe_answer (host, seq);
+
+	if (obj->run_active)
+		ping_host_done (obj, host);
+	else
+		ping_heap_remove (obj, host);
+
+	return (0);
+}
+
+static void ping_receive_msghdr (pingobj_t *obj, struct msghdr *msghdr,
+		struct iovec *iov, size_t index)
+{
+	iov->iov_base = obj->recv_buffer + (index * obj->recv_len);
+	iov->iov_len = obj->recv_len;
+
+	memset (msghdr, 0, sizeof (*msghdr));
+	/* source address, see "ping_addr_lookup" */
+	msghdr->msg_name = obj->recv_addrs + index;
+	msghdr->msg_namelen = sizeof (*obj->recv_addrs);
+	/* output buffer vector, see readv(2) */
+	msghdr->msg_iov = iov;
+	msghdr->msg_iovlen = 1;
+	/* output buffer for control messages */
+	msghdr->msg_control = obj->recv_control + (index * PING_CONTROL_LEN);
+	msghdr->msg_controllen = PING_CONTROL_LEN;
 	/* flags; this is an output only field.. */
-	msghdr.msg_flags = 0;
+	msghdr->msg_flags = 0;
 #ifdef MSG_XPG4_2
-	msghdr.msg_flags |= MSG_XPG4_2;
+	msghdr->msg_flags |= MSG_XPG4_2;
+#endif
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Transmit timestamps:                                                      *
+ *                                                                           *
+ * With PING_OPT_TIMESTAMPING the sockets report the time each echo request  *
+ * was handed to the network device on their error queue (SO_TIMESTAMPING).  *
+ * The kernel numbers the requests sent on a socket, starting at zero; the   *
+ * socket's "stamps" ring maps these numbers back to the host's slot and     *
+ * sequence number, and the request's send time is replaced by the kernel's. *
+ * The error queue is read before the replies, so the replies see the new    *
+ * time. Requests whose timestamp is lost keep the time taken before sending.*
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static struct pingtx *ping_tx_get (pingobj_t *obj, int addrfam)
+{
+	return ((addrfam == AF_INET6) ? &obj->tx6 : &obj->tx4);
+}
+
+/* ping_tx_setup turns transmit timestamps on the socket "fd" of address
+ * family "addrfam" on or off, as obj->timestamping says. If the kernel does
+ * not support them, send times are taken before sending as usual. */
+static void ping_tx_setup (pingobj_t *obj, int fd, int addrfam)
+{
+#if PING_USE_TIMESTAMPING
+	struct pingtx *tx = ping_tx_get (obj, addrfam);
+	int flags = 0;
+
+	if (obj->timestamping == tx->enabled)
+		return;
+
+	if (obj->timestamping)
+	{
+		flags = SOF_TIMESTAMPING_TX_SOFTWARE
+			| SOF_TIMESTAMPING_SOFTWARE
+			| SOF_TIMESTAMPING_OPT_ID
+			| SOF_TIMESTAMPING_OPT_TSONLY;
+
+		if (tx->stamps == NULL)
+			tx->stamps = calloc (PING_TX_STAMPS_LEN,
+					sizeof (*tx->stamps));
+		if (tx->stamps == NULL)
+			return;
+
+		/* Turning on SOF_TIMESTAMPING_OPT_ID numbers the requests
+		 * from zero again. */
+		memset (tx->stamps, 0,
+				PING_TX_STAMPS_LEN * sizeof (*tx->stamps));
+		tx->key = 0;
+	}
+
+	if (setsockopt (fd, SOL_SOCKET, SO_TIMESTAMPING,
+				&flags, sizeof (flags)) != 0)
+	{
+#if WITH_DEBUG
+		char errbuf[PING_ERRMSG_LEN];
+		dprintf ("setsockopt (SO_TIMESTAMPING): %s\n",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+#endif
+		if (obj->timestamping)
+		{
+			free (tx->stamps);
+			tx->stamps = NULL;
+		}
+		return;
+	}
+
+	tx->enabled = obj->timestamping;
+#else
+	(void) obj;
+	(void) fd;
+	(void) addrfam;
+#endif /* PING_USE_TIMESTAMPING */
+} /* void ping_tx_setup */
+
+/* ping_tx_sent is called when the echo request with the host's current
+ * sequence number has been accepted by the socket. */
+static void ping_tx_sent (pingobj_t *obj, pinghost_t *ph)
+{
+	struct pingtx *tx = ping_tx_get (obj, ph->addrfamily);
+	struct pingtxstamp *ts;
+
+	if (!tx->enabled)
+		return;
+
+	ts = tx->stamps + (tx->key & (PING_TX_STAMPS_LEN - 1));
+	ts->key   = tx->key;
+	ts->slot  = ph->slot;
+	ts->seq   = ping_probe_seq (ph, ph->sequence);
+	ts->valid = 1;
+
+	tx->key++;
+}
+
+#if PING_USE_TIMESTAMPING
+/* ping_tx_stamp sets the send time of the echo request the socket numbered
+ * "key" to "kernel", a CLOCK_REALTIME timestamp. "now" and "offset" are as in
+ * "ping_receive_one". */
+static void ping_tx_stamp (pingobj_t *obj, struct pingtx *tx, uint32_t key,
+		struct timespec *kernel, struct timespec *now,
+		struct timespec *offset)
+{
+	struct pingtxstamp *ts = tx->stamps + (key & (PING_TX_STAMPS_LEN - 1));
+	struct timespec *sent;
+	struct timespec stamp;
+	pinghost_t *ph;
+
+	if (!ts->valid || (ts->key != key))
+		return;
+	ts->valid = 0;
+
+	if (ts->slot >= obj->slots_num)
+		return;
+	ph = obj->slots[ts->slot];
+	if (ph == NULL)
+		return;
+
+	sent = ping_probe_find (ph, ts->seq);
+	if (sent == NULL)
+		return;
+
+	/* The request cannot have left before it was sent nor after now. */
+	if ((ping_timespec_sub (kernel, offset, &stamp) != 0)
+			|| (ping_timespec_cmp (&stamp, sent) < 0)
+			|| (ping_timespec_cmp (&stamp, now) > 0))
+		return;
+
+	dprintf ("tx stamp for %s: +%lins\n", ping_host_hostname (ph),
+			(long) (ping_timespec_ns (&stamp)
+				- ping_timespec_ns (sent)));
+	*sent = stamp;
+}
+
+/* ping_tx_cmsg_stamp stores the send time carried by "cmsg", if any, in
+ * "kernel" and returns non-zero if there was one. */
+static int ping_tx_cmsg_stamp (struct cmsghdr *cmsg, struct timespec *kernel)
+{
+	struct scm_timestamping tss;
+
+	if ((cmsg->cmsg_level != SOL_SOCKET)
+			|| (cmsg->cmsg_type != SCM_TIMESTAMPING))
+		return (0);
+
+	memcpy (&tss, CMSG_DATA (cmsg), sizeof (tss));
+	*kernel = tss.ts[0];
+	return (ping_timespec_isset (kernel));
+}
+
+/* ping_tx_cmsg_key stores the key of the echo request a send time belongs
+ * to, see "ping_tx_sent", in "key" and returns non-zero if "cmsg" carries
+ * one. */
+static int ping_tx_cmsg_key (struct cmsghdr *cmsg, uint32_t *key)
+{
+	struct sock_extended_err serr;
+
+	if (!((cmsg->cmsg_level == IPPROTO_IP)
+				&& (cmsg->cmsg_type == IP_RECVERR))
+			&& !((cmsg->cmsg_level == IPPROTO_IPV6)
+				&& (cmsg->cmsg_type == IPV6_RECVERR)))
+		return (0);
+
+	memcpy (&serr, CMSG_DATA (cmsg), sizeof (serr));
+	if ((serr.ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+			|| (serr.ee_info != SCM_TSTAMP_SND))
+		return (0);
+
+	*key = serr.ee_data;
+	return (1);
+}
+#endif /* PING_USE_TIMESTAMPING */
+
+/* ping_tx_receive reads the error queue of the socket of address family
+ * "addrfam" until it is empty and applies the transmit timestamps found.
+ * "now" and "offset" are as in "ping_receive_one". */
+static void ping_tx_receive (pingobj_t *obj, struct timespec *now,
+		struct timespec *offset, int addrfam)
+{
+#if PING_USE_TIMESTAMPING
+	struct pingtx *tx = ping_tx_get (obj, addrfam);
+	int fd = addrfam == AF_INET6 ? obj->fd6 : obj->fd4;
+
+	if (tx->stamps == NULL)
+		return;
+
+	while (1)
+	{
+		struct msghdr msghdr;
+		struct iovec iov;
+		struct cmsghdr *cmsg;
+		struct timespec kernel;
+		uint32_t key = 0;
+		int have_stamp = 0;
+		int have_key = 0;
+
+		ping_receive_msghdr (obj, &msghdr, &iov, 0);
+		if (recvmsg (fd, &msghdr, MSG_ERRQUEUE) < 0)
+			break;
+
+		for (cmsg = CMSG_FIRSTHDR (&msghdr);
+				cmsg != NULL;
+				cmsg = CMSG_NXTHDR (&msghdr, cmsg))
+		{
+			if (ping_tx_cmsg_stamp (cmsg, &kernel))
+				have_stamp = 1;
+			else if (ping_tx_cmsg_key (cmsg, &key))
+				have_key = 1;
+		}
+
+		if (have_stamp && have_key && (offset != NULL))
+			ping_tx_stamp (obj, tx, key, &kernel, now, offset);
+	}
+#else
+	(void) obj;
+	(void) now;
+	(void) offset;
+	(void) addrfam;
+#endif /* PING_USE_TIMESTAMPING */
+} /* void ping_tx_receive */
+
+/* ping_receive_all reads datagrams from the socket of address family
+ * "addrfam" until it would block. With recvmmsg(2), up to obj->batch_size
+ * datagrams are read per system call into the object's receive buffers.
+ * Returns the number of echo replies received, or -1 if the buffers could not
+ * be allocated. */
+static int ping_receive_all (pingobj_t *obj, struct timespec *now, int addrfam)
+{
+	int fd = addrfam == AF_INET6 ? obj->fd6 : obj->fd4;
+	int received = 0;
+	struct timespec offset;
+	struct timespec *offset_ptr = &offset;
+
+	if (ping_batch_alloc (obj) != 0)
+		return (-1);
+
+	if (ping_clock_offset (&offset) != 0)
+		offset_ptr = NULL;
+
+	ping_tx_receive (obj, now, offset_ptr, addrfam);
+
+	while (1)
+	{
+#if HAVE_RECVMMSG
+		int status;
+		int i;
+
+		for (i = 0; i < obj->batch_size; i++)
+			ping_receive_msghdr (obj, &obj->recv_msgs[i].msg_hdr,
+					obj->recv_iov + i, (size_t) i);
+
+		status = recvmmsg (fd, obj->recv_msgs,
+				(unsigned int) obj->batch_size,
+				/* flags = */ 0, /* timeout = */ NULL);
+#else
+		struct msghdr msghdr;
+		struct iovec iov;
+		ssize_t status;
+
+		ping_receive_msghdr (obj, &msghdr, &iov, 0);
+		status = recvmsg (fd, &msghdr, /* flags = */ 0);
+#endif
+		if (status < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				*ping_event_ready (obj, addrfam)
+					&= ~PING_FD_READABLE;
+			}
+#if WITH_DEBUG
+			else
+			{
+				char errbuf[PING_ERRMSG_LEN];
+				dprintf ("recvmsg: %s\n",
+						sstrerror (errno, errbuf,
+							sizeof (errbuf)));
+			}
+#endif
+			break;
+		}
+
+#if HAVE_RECVMMSG
+		dprintf ("recvmmsg: read %i datagrams from fd = %i\n",
+				status, fd);
+		for (i = 0; i < status; i++)
+			if (ping_receive_one (obj, &obj->recv_msgs[i].msg_hdr,
+						obj->recv_msgs[i].msg_len,
+						now, offset_ptr, addrfam) == 0)
+				received++;
+#else
+		if (ping_receive_one (obj, &msghdr, (size_t) status,
+					now, offset_ptr, addrfam) == 0)
+			received++;
+#endif
+	}
+
+	return (received);
+} /* int ping_receive_all */
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Packet templates:                                                         *
+ *                                                                           *
+ * Each host keeps the start of its echo request in "packet": the ICMP      *
+ * header and the payload header if enabled. The data, shared with other     *
+ * hosts, is sent from where it is. Only the sequence number and the send    *
+ * time change from one request to the next, so sending patches these fields *
+ * in place and updates the ICMPv4 checksum incrementally (RFC 1624) from    *
+ * "packet_sum", the sum of the template with these fields zero plus the     *
+ * data's. The cost per request does not depend on the size of the data.     *
+ * ICMPv6 and ping sockets have the kernel calculate the checksum.           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void ping_packet_build (pingobj_t *obj, pinghost_t *ph)
+{
+	struct timespec zero = { 0, 0 };
+	char *packet = (char *) ph->packet;
+	size_t hdrlen;
+
+	hdrlen = obj->payload_header ? PING_PAYLOAD_HEADER_LEN : 0;
+
+	memset (ph->packet, 0, sizeof (ph->packet));
+	if (ph->addrfamily == AF_INET6)
+	{
+		struct icmp6_hdr *icmp6 = (struct icmp6_hdr *) packet;
+
+		icmp6->icmp6_type = ICMP6_ECHO_REQUEST;
+		icmp6->icmp6_id   = htons (ph->ident);
+	}
+	else
+	{
+		struct icmp *icmp4 = (struct icmp *) packet;
+
+		icmp4->icmp_type = ICMP_ECHO;
+		icmp4->icmp_id   = htons (ph->ident);
+	}
+
+	if (hdrlen > 0)
+		ping_payload_write (obj, ph, &zero, packet + ICMP_MINLEN);
+
+	/* The template's length is even, so the data's sum can be added. */
+	ph->packet_len    = ICMP_MINLEN + hdrlen;
+	ph->packet_sum    = ping_checksum_add (ph->data->sum, packet,
+			ph->packet_len);
+	ph->packet_header = obj->payload_header;
+}
+
+/* ping_packet_prepare fills the sequence number and send time of the host's
+ * next echo request into its template and points "iov" at the request: the
+ * template, followed by the data unless that is empty. Returns the number of
+ * elements of "iov" used. The request's send time must have been set
+ * already. */
+static int ping_packet_prepare (pingobj_t *obj, pinghost_t *ph,
+		struct iovec *iov)
+{
+	char *packet = (char *) ph->packet;
+	uint16_t seq;
+
+	if ((ph->packet_len == 0) || (ph->packet_header != obj->payload_header))
+		ping_packet_build (obj, ph);
+
+	seq = htons (ping_probe_seq (ph, ph->sequence));
+	if (ph->packet_header)
+		ping_payload_stamp (ping_probe_timer (ph, ph->sequence),
+				packet + ICMP_MINLEN);
+
+	if (ph->addrfamily == AF_INET6)
+	{
+		((struct icmp6_hdr *) packet)->icmp6_seq = seq;
+	}
+	else
+	{
+		struct icmp *icmp4 = (struct icmp *) packet;
+		uint64_t sum = ph->packet_sum;
+
+		icmp4->icmp_seq = seq;
+		if (!obj->dgram)
+		{
+			sum += seq;
+			if (ph->packet_header)
+				sum = ping_checksum_add (sum,
+						packet + ICMP_MINLEN
+						+ PING_PAYLOAD_STAMP_OFFSET,
+						PING_PAYLOAD_HEADER_LEN
+						- PING_PAYLOAD_STAMP_OFFSET);
+			icmp4->icmp_cksum = ping_checksum_fold (sum);
+		}
+	}
+
+	iov[0].iov_base = packet;
+	iov[0].iov_len  = ph->packet_len;
+	if (ph->data->size == 0)
+		return (1);
+
+	iov[1].iov_base = ph->data->data;
+	iov[1].iov_len  = ph->data->size;
+	return (2);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sending functions:                                                        *
+ *                                                                           *
+ * ping_send_batch                                                           *
+ * +-> sendmmsg (ping_packet_prepare)                                        *
+ * `-> ping_send_one                                                         *
+ *     +-> ping_send_one_ipv4                                                *
+ *     `-> ping_send_one_ipv6                                                *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Returns true for errors after which the echo request is simply considered
+ * lost rather than failed. */
+static int ping_send_error_ignore (int error_number)
+{
+#if defined(EHOSTUNREACH)
+	if (error_number == EHOSTUNREACH)
+		return (1);
+#endif
+#if defined(ENETUNREACH)
+	if (error_number == ENETUNREACH)
+		return (1);
+#endif
+	/* BSDs return EHOSTDOWN on ARP/ND failure */
+#if defined(EHOSTDOWN)
+	if (error_number == EHOSTDOWN)
+		return (1);
+#endif
+	return (0);
+}
+
+static ssize_t ping_sendto (pingobj_t *obj, pinghost_t *ph,
+		struct iovec *iov, int iovlen, int fd)
+{
+	struct msghdr msghdr;
+	ssize_t ret;
+
+	memset (&msghdr, 0, sizeof (msghdr));
+	msghdr.msg_name = &ph->addr;
+	msghdr.msg_namelen = ph->addrlen;
+	msghdr.msg_iov = iov;
+	msghdr.msg_iovlen = (size_t) iovlen;
+
+	ret = sendmsg (fd, &msghdr, /* flags = */ 0);
+
+	if (ret >= 0)
+		ping_tx_sent (obj, ph);
+	else
+	{
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		{
+			*ping_event_ready (obj, ph->addrfamily)
+				&= ~PING_FD_WRITABLE;
+			return (-1);
+		}
+		if (ping_send_error_ignore (errno))
+			return (0);
+		ping_set_errno (obj, errno);
+	}
+
+	return (ret);
+}
+
+/* ping_send_one_icmp sends the ICMPv4 or ICMPv6 echo request of "ph" on
+ * "fd". Returns zero on success, EAGAIN if the socket is not writable and -1
+ * on error. */
+static int ping_send_one_icmp (pingobj_t *obj, pinghost_t *ph, int fd)
+{
+	int status;
+
+	struct iovec iov[PING_PACKET_IOV_LEN];
+	int iovlen;
+
+	dprintf ("ph->hostname = %s\n", ping_host_hostname (ph));
+
+	iovlen = ping_packet_prepare (obj, ph, iov);
+
+	dprintf ("Sending ICMPv%i package with ID 0x%04x\n",
+			(ph->addrfamily == AF_INET6) ? 6 : 4, ph->ident);
+
+	status = ping_sendto (obj, ph, iov, iovlen, fd);
+	if (status < 0)
+	{
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			return (EAGAIN);
+		perror ("ping_sendto");
+		return (-1);
+	}
+
+	dprintf ("sendto: status = %i\n", status);
+
+	return (0);
+}
+
+/* ping_send_one sends an echo request to "ptr", using "now" as the send
+ * time. Returns zero on success, EAGAIN if the socket is not writable and -1
+ * on error. */
+static int ping_send_one (pingobj_t *obj, pinghost_t *ptr, int fd,
+		struct timespec *now)
+{
+	struct timespec *timer = ping_probe_timer (ptr, ptr->sequence);
+	int status;
+
+	/* start timer.. The GNU `ping6' starts the timer before sending the
+	 * packet, so I will do that too */
+	*timer = *now;
+	dprintf ("timer set for hostname = %s\n", ping_host_hostname (ptr));
+
+	if (ptr->addrfamily == AF_INET6)
+	{
+		dprintf ("Sending ICMPv6 echo request to `%s'\n",
+				ping_host_hostname (ptr));
+		status = ping_send_one_icmp (obj, ptr, fd);
+	}
+	else if (ptr->addrfamily == AF_INET)
+	{
+		dprintf ("Sending ICMPv4 echo request to `%s'\n",
+				ping_host_hostname (ptr));
+		status = ping_send_one_icmp (obj, ptr, fd);
+	}
+	else /* this should not happen */
+	{
+		dprintf ("Unknown address family: %i\n", ptr->addrfamily);
+		status = -1;
+	}
+
+	if (status == EAGAIN)
+	{
+		/* The socket's send buffer is full. The caller retries this
+		 * host once the socket becomes writable again. */
+		ping_probe_unsent (ptr);
+		return (EAGAIN);
+	}
+	else if (status != 0)
+	{
+		ping_probe_unsent (ptr);
+		return (-1);
+	}
+
+	ping_probe_sent (ptr);
+
+	return (0);
+}
+
+/* Returns "ph" or the first host after it with address family "addrfam". */
+static pinghost_t *ping_next_host (pinghost_t *ph, int addrfam)
+{
+	while ((ph != NULL) && (ph->addrfamily != addrfam))
+		ph = ph->next;
+
+	return (ph);
+}
+
+/* ping_send_batch sends echo requests to up to obj->batch_size, but no more
+ * than "limit", hosts of address family "addrfam", starting with "*hosts".
+ * Using sendmmsg(2) this
+ * takes a single system call. "*hosts" is advanced past all hosts that have
+ * been handled, successfully or not. Hosts that could not be sent to because
+ * the socket is not writable are left for the next call. Returns the number
+ * of echo requests sent; failures are added to "error_count". */
+static int ping_send_batch (pingobj_t *obj, pinghost_t **hosts, int addrfam,
+		int limit, struct timespec *now, int *error_count)
+{
+	int fd = (addrfam == AF_INET6) ? obj->fd6 : obj->fd4;
+	int sent = 0;
+
+	if (limit > obj->batch_size)
+		limit = obj->batch_size;
+
+#if HAVE_SENDMMSG
+	if ((obj->batch_size > 1) && (ping_batch_alloc (obj) == 0))
+	{
+		pinghost_t *ph;
+		unsigned int num = 0;
+		unsigned int done = 0;
+		unsigned int i;
+
+		for (ph = *hosts;
+				(ph != NULL) && (num < (unsigned int) limit);
+				ph = ping_next_host (ph->next, addrfam))
+		{
+			struct mmsghdr *msg = obj->send_msgs + num;
+			struct iovec *iov = obj->send_iov
+				+ (num * PING_PACKET_IOV_LEN);
+
+			/* The kernel copies the request, so the template
+			 * is sent as is. */
+			*ping_probe_timer (ph, ph->sequence) = *now;
+			obj->send_hosts[num] = ph;
+
+			memset (msg, 0, sizeof (*msg));
+			msg->msg_hdr.msg_name = &ph->addr;
+			msg->msg_hdr.msg_namelen = ph->addrlen;
+			msg->msg_hdr.msg_iov = iov;
+			msg->msg_hdr.msg_iovlen = (size_t)
+				ping_packet_prepare (obj, ph, iov);
+
+			num++;
+		}
+
+		while (done < num)
+		{
+			pinghost_t *first = obj->send_hosts[done];
+			int status = sendmmsg (fd, obj->send_msgs + done,
+					num - done, /* flags = */ 0);
+			int lost = 0;
+
+			if (status < 0)
+			{
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				{
+					*ping_event_ready (obj, addrfam)
+						&= ~PING_FD_WRITABLE;
+					break;
+				}
+				else if (!ping_send_error_ignore (errno))
+				{
+					ping_set_errno (obj, errno);
+					ping_probe_unsent (first);
+					(*error_count)++;
+					done++;
+					continue;
+				}
+
+				/* The first request is considered lost. */
+				status = 1;
+				lost = 1;
+			}
+
+			dprintf ("sendmmsg: sent %i of %u echo requests\n",
+					status, num - done);
+
+			for (i = done; i < done + (unsigned int) status; i++)
+			{
+				if (!lost)
+					ping_tx_sent (obj, obj->send_hosts[i]);
+				ping_probe_sent (obj->send_hosts[i]);
+				ping_host_sent (obj, obj->send_hosts[i]);
+			}
+
+			sent += status;
+			done += (unsigned int) status;
+		}
+
+		for (i = done; i < num; i++)
+			ping_probe_unsent (obj->send_hosts[i]);
+
+		if (done < num)
+			*hosts = obj->send_hosts[done];
+		else
+			*hosts = ph;
+
+		return (sent);
+	}
+#endif /* HAVE_SENDMMSG */
+
+	while ((*hosts != NULL) && (sent < limit))
+	{
+		int status = ping_send_one (obj, *hosts, fd, now);
+
+		/* Retry the same host once the socket is writable again. */
+		if (status == EAGAIN)
+			break;
+
+		if (status == 0)
+		{
+			ping_host_sent (obj, *hosts);
+			sent++;
+		}
+		else
+			(*error_count)++;
+
+		*hosts = ping_next_host ((*hosts)->next, addrfam);
+	}
+
+	return (sent);
+} /* int ping_send_batch */
+
+/*
+ * Set the TTL of a socket protocol independently.
+ */
+static int ping_set_ttl (pingobj_t *obj, int ttl)
+{
+	int ret = 0;
+	char errbuf[PING_ERRMSG_LEN];
+
+	if (obj->fd4 != -1)
+	{
+		if (setsockopt (obj->fd4, IPPROTO_IP, IP_TTL,
+				&ttl, sizeof (ttl)))
+		{
+			ret = errno;
+			ping_set_error (obj, "ping_set_ttl",
+					sstrerror (ret, errbuf, sizeof (errbuf)));
+			dprintf ("Setting TTLv4 failed: %s\n", errbuf);
+		}
+	}
+
+	if (obj->fd6 != -1)
+	{
+		dprintf ("Setting TTLv6 to %i\n", ttl);
+		if (setsockopt (obj->fd6, IPPROTO_IPV6, IPV6_UNICAST_HOPS,
+				&ttl, sizeof (ttl)))
+		{
+			ret = errno;
+			ping_set_error (obj, "ping_set_ttl",
+					sstrerror (ret, errbuf, sizeof (errbuf)));
+			dprintf ("Setting TTLv6 failed: %s\n", errbuf);
+		}
+	}
+
+	return (ret);
+}
+
+/*
+ * Set the TOS of a socket protocol independently.
+ *
+ * Using SOL_SOCKET / SO_PRIORITY might be a protocol independent way to
+ * set this. See socket(7) for details.
+ */
+static int ping_set_qos (pingobj_t *obj, uint8_t qos)
+{
+	int ret = 0;
+	char errbuf[PING_ERRMSG_LEN];
+
+	if (obj->fd4 != -1)
+	{
+		dprintf ("Setting TP_TOS to %#04"PRIx8"\n", qos);
+		if (setsockopt (obj->fd4, IPPROTO_IP, IP_TOS,
+				&qos, sizeof (qos)))
+		{
+			ret = errno;
+			ping_set_error (obj, "ping_set_qos",
+					sstrerror (ret, errbuf, sizeof (errbuf)));
+			dprintf ("Setting TP_TOS failed: %s\n", errbuf);
+		}
+	}
+
+	if (obj->fd6 != -1)
+	{
+		/* IPV6_TCLASS requires an "int". */
+		int tmp = (int) qos;
+
+		dprintf ("Setting IPV6_TCLASS to %#04"PRIx8" (%i)\n", qos, tmp);
+		if (setsockopt (obj->fd6, IPPROTO_IPV6, IPV6_TCLASS,
+			&tmp, sizeof (tmp)))
+		{
+			ret = errno;
+			ping_set_error (obj, "ping_set_qos",
+					sstrerror (ret, errbuf, sizeof (errbuf)));
+			dprintf ("Setting IPV6_TCLASS failed: %s\n", errbuf);
+		}
+	}
+
+	return (ret);
+}
+
+static int ping_get_ident (void)
+{
+	int fd;
+	static int did_seed = 0;
+
+	int retval;
+
+	if (did_seed == 0)
+	{
+		if ((fd = open ("/dev/urandom", O_RDONLY)) != -1)
+		{
+			unsigned int seed;
+
+			if (read (fd, &seed, sizeof (seed)) != -1)
+			{
+				did_seed = 1;
+				dprintf ("Random seed:   %#x\n", seed);
+				srandom (seed);
+			}
+
+			close (fd);
+		}
+#if WITH_DEBUG
+		else
+		{
+			char errbuf[PING_ERRMSG_LEN];
+			dprintf ("open (/dev/urandom): %s\n",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+		}
 #endif
+	}
+
+	retval = (int) random ();
+
+	dprintf ("Random number: %#x\n", retval);
+
+	return (retval);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Host records:                                                             *
+ *                                                                           *
+ * Host records are allocated in blocks, each holding "size" records. Block  *
+ * sizes double, from PING_HOST_BLOCK_MIN up to PING_HOST_BLOCK_MAX records, *
+ * so an object with many hosts has few blocks. Hosts added one after the    *
+ * other are neighbours in memory, so the loops over all hosts and the send  *
+ * time sweeps walk memory in order. The fields used every round are at the  *
+ * start of "struct pinghost".                                               *
+ *                                                                           *
+ * A record holds the host's address and a one entry probe window itself.    *
+ * What hosts added by address range mostly do without, the names, RTT       *
+ * history and a larger probe window, is allocated on first use: see         *
+ * "ping_host_ext" and "ping_probe_grow". A range host that never replies    *
+ * thus costs one record only.                                               *
+ *                                                                           *
+ * Records never move: iterators point at them. Removed hosts' records are   *
+ * kept in hosts_free, linked through "next", and reused by "ping_alloc".    *
+ * Blocks are freed by "ping_destroy" only.                                  *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define PING_HOST_BLOCK_MIN 16
+#define PING_HOST_BLOCK_MAX 1024
+
+static struct pinghostblock *ping_host_block_new (size_t size)
+{
+	struct pinghostblock *block;
+	size_t block_size;
+
+	block_size = sizeof (*block) + size * sizeof (pinghost_t);
+
+	block = malloc (block_size);
+	if (block == NULL)
+		return (NULL);
+
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+
+	return (block);
+}
+
+/* Returns an unused record of the newest block, adding a block if that is
+ * full. */
+static pinghost_t *ping_host_block_take (pingobj_t *obj)
+{
+	struct pinghostblock *block = obj->host_blocks;
+
+	if ((block == NULL) || (block->used >= block->size))
+	{
+		size_t size = (block == NULL) ? PING_HOST_BLOCK_MIN
+			: 2 * block->size;
+
+		if (size > PING_HOST_BLOCK_MAX)
+			size = PING_HOST_BLOCK_MAX;
+
+		block = ping_host_block_new (size);
+		if (block == NULL)
+			return (NULL);
+		block->next = obj->host_blocks;
+		obj->host_blocks = block;
+	}
+
+	return (block->hosts + block->used++);
+}
+
+/* ping_host_block_reserve makes room for "num" hosts in all, so adding them
+ * allocates no further block. */
+static int ping_host_block_reserve (pingobj_t *obj, size_t num)
+{
+	struct pinghostblock *block = obj->host_blocks;
+	size_t avail = obj->hosts_num + obj->hosts_free_num;
+
+	if (block != NULL)
+		avail += block->size - block->used;
+	if (num <= avail)
+		return (0);
+
+	/* New records are taken from the newest block only; put the rest of
+	 * the current one on the free list. */
+	while ((block != NULL) && (block->used < block->size))
+	{
+		pinghost_t *ph = ping_host_block_take (obj);
+
+		ph->next = obj->hosts_free;
+		obj->hosts_free = ph;
+		obj->hosts_free_num++;
+	}
+
+	block = ping_host_block_new (num - avail);
+	if (block == NULL)
+	{
+		ping_set_errno (obj, errno);
+		return (-1);
+	}
+	block->next = obj->host_blocks;
+	obj->host_blocks = block;
+
+	return (0);
+}
+
+static pinghost_t *ping_alloc (pingobj_t *obj)
+{
+	pinghost_t *ph;
+
+	if (obj->hosts_free != NULL)
+	{
+		ph = obj->hosts_free;
+		obj->hosts_free = ph->next;
+		obj->hosts_free_num--;
+	}
+	else if ((ph = ping_host_block_take (obj)) == NULL)
+	{
+		return (NULL);
+	}
+
+	memset (ph, '\0', sizeof (*ph));
+
+	ph->timer   = &ph->timer_one;
+	ph->window  = 1;
+	ph->addrlen = sizeof (ph->addr);
+	ph->latency = -1.0;
+	ph->latency_ns = -1;
+	ph->srtt    = -1.0;
+	ph->dropped = 0;
+	ph->heap_index = -1;
+
+	return (ph);
+}
+
+/* ping_free_ext frees what the record of "ph" points to besides its data:
+ * the extension with the names and a grown probe window. */
+static void ping_free_ext (pinghost_t *ph)
+{
+	if (ph->ext != NULL)
+	{
+		if (ph->ext->hostname != ph->ext->username)
+			free (ph->ext->hostname);
+		free (ph->ext->username);
+		free (ph->ext);
+		ph->ext = NULL;
+	}
+
+	if (ph->timer != &ph->timer_one)
+		free (ph->timer);
+	ph->timer = &ph->timer_one;
+	ph->window = 1;
+}
+
+static void ping_free (pingobj_t *obj, pinghost_t *ph)
+{
+	if (ph == NULL)
+		return;
+
+	ping_free_ext (ph);
+	ping_data_unref (ph->data);
+	ph->data = NULL;
 
-	payload_buffer_len = recvmsg (fd, &msghdr, /* flags = */ 0);
-	if (payload_buffer_len < 0)
+	ph->next = obj->hosts_free;
+	obj->hosts_free = ph;
+	obj->hosts_free_num++;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Socket filters:                                                           *
+ *                                                                           *
+ * A raw socket receives a copy of every ICMP packet, including other        *
+ * processes' echo replies. A classic BPF filter has the kernel drop all but *
+ * echo replies to our idents before they are queued. Since the idents are   *
+ * ident_base plus the slot number (see "ping_slot_alloc"), this is a range  *
+ * check against the size of the slot table; the filter is replaced when    *
+ * the table grows. On the IPv6 socket, ICMP6_FILTER drops other ICMPv6      *
+ * types even earlier. Ping sockets (PING_OPT_DGRAM) need neither.           *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void ping_filter_attach (pingobj_t *obj, int fd, int addrfam)
+{
+#if PING_USE_BPF
+	uint32_t num = (obj->slots_size < 0x10000)
+		? (uint32_t) obj->slots_size : 0x10000;
+	/* Raw IPv4 sockets see the IP header, raw IPv6 sockets don't. */
+	struct sock_filter filter4[] = {
+		BPF_STMT (BPF_LDX | BPF_B | BPF_MSH, 0),
+		BPF_STMT (BPF_LD | BPF_B | BPF_IND, 0),
+		BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 5),
+		BPF_STMT (BPF_LD | BPF_H | BPF_IND, 4),
+		BPF_STMT (BPF_ALU | BPF_SUB | BPF_K, obj->ident_base),
+		BPF_STMT (BPF_ALU | BPF_AND | BPF_K, 0xFFFF),
+		BPF_JUMP (BPF_JMP | BPF_JGE | BPF_K, num, 1, 0),
+		BPF_STMT (BPF_RET | BPF_K, 0xFFFFFFFF),
+		BPF_STMT (BPF_RET | BPF_K, 0),
+	};
+	struct sock_filter filter6[] = {
+		BPF_STMT (BPF_LD | BPF_B | BPF_ABS, 0),
+		BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ICMP6_ECHO_REPLY, 0, 5),
+		BPF_STMT (BPF_LD | BPF_H | BPF_ABS, 4),
+		BPF_STMT (BPF_ALU | BPF_SUB | BPF_K, obj->ident_base),
+		BPF_STMT (BPF_ALU | BPF_AND | BPF_K, 0xFFFF),
+		BPF_JUMP (BPF_JMP | BPF_JGE | BPF_K, num, 1, 0),
+		BPF_STMT (BPF_RET | BPF_K, 0xFFFFFFFF),
+		BPF_STMT (BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog;
+
+	if (addrfam == AF_INET6)
+	{
+		prog.len = sizeof (filter6) / sizeof (filter6[0]);
+		prog.filter = filter6;
+	}
+	else
+	{
+		prog.len = sizeof (filter4) / sizeof (filter4[0]);
+		prog.filter = filter4;
+	}
+
+	/* Without the filter, foreign packets are dropped in userspace. */
+	if (setsockopt (fd, SOL_SOCKET, SO_ATTACH_FILTER,
+				&prog, sizeof (prog)) != 0)
 	{
 #if WITH_DEBUG
 		char errbuf[PING_ERRMSG_LEN];
-		dprintf ("recvfrom: %s\n",
+		dprintf ("setsockopt (SO_ATTACH_FILTER): %s\n",
 				sstrerror (errno, errbuf, sizeof (errbuf)));
 #endif
-		return (-1);
 	}
-	dprintf ("Read %zi bytes from fd = %i\n", payload_buffer_len, fd);
+#else
+	(void) obj;
+	(void) fd;
+	(void) addrfam;
+#endif /* PING_USE_BPF */
+}
 
-	/* Iterate over all auxiliary data in msghdr */
-	recv_ttl = -1;
-	recv_qos = 0;
-	for (cmsg = CMSG_FIRSTHDR (&msghdr); /* {{{ */
-			cmsg != NULL;
-			cmsg = CMSG_NXTHDR (&msghdr, cmsg))
+/* ping_filter_update replaces the filters of the open sockets if the slot
+ * table has grown since they were attached. */
+static void ping_filter_update (pingobj_t *obj)
+{
+	if (obj->dgram || (obj->filter_size == obj->slots_size))
+		return;
+
+	if (obj->fd4 != -1)
+		ping_filter_attach (obj, obj->fd4, AF_INET);
+	if (obj->fd6 != -1)
+		ping_filter_attach (obj, obj->fd6, AF_INET6);
+
+	obj->filter_size = obj->slots_size;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Host name resolution:                                                     *
+ *                                                                           *
+ * Adding a host is split in two: "ping_host_resolve" runs getaddrinfo(3),   *
+ * which may wait for the network but touches no object state, and          *
+ * "ping_host_add_resolved" adds the host from the result. The latter runs   *
+ * in the caller's thread, in the order the hosts were given, so             *
+ * "ping_host_add_many" adds exactly the hosts the same calls to             *
+ * "ping_host_add" would, in the same order, while up to                     *
+ * PING_RESOLVE_THREADS threads resolve the names in parallel.               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct pinghostquery
+{
+	const char              *host;
+	int                      addrfamily;
+	/* Set if the host need not be resolved, e.g. because it has been
+	 * added before. */
+	int                      skip;
+	/* Set if the host is an address literal, parsed into "addr" without
+	 * getaddrinfo(3). */
+	int                      numeric;
+	struct sockaddr_storage  addr;
+	socklen_t                addrlen;
+	struct addrinfo         *ai_list;
+	int                      ai_return;
+	int                      ai_errno;
+};
+
+/* ping_host_parse parses "host" as an IPv4 or IPv6 address of family
+ * "addrfamily" (either if AF_UNSPEC) into "ss". Returns zero on success. Other
+ * forms getaddrinfo(3) accepts, like IPv6 addresses with a scope, are left to
+ * it. */
+static int ping_host_parse (const char *host, int addrfamily,
+		struct sockaddr_storage *ss, socklen_t *ss_len)
+{
+	memset (ss, 0, sizeof (*ss));
+
+	if ((addrfamily == AF_UNSPEC) || (addrfamily == AF_INET))
 	{
-		if (cmsg->cmsg_level == SOL_SOCKET)
+		struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+
+		if (inet_pton (AF_INET, host, &sin->sin_addr) == 1)
 		{
-#ifdef SO_TIMESTAMP
-			if (cmsg->cmsg_type == SO_TIMESTAMP)
-				memcpy (&pkt_now, CMSG_DATA (cmsg), sizeof (pkt_now));
-#endif /* SO_TIMESTAMP */
+			sin->sin_family = AF_INET;
+			*ss_len = sizeof (*sin);
+			return (0);
 		}
-		else if (addrfam == AF_INET) /* {{{ */
-		{
-			if (cmsg->cmsg_level != IPPROTO_IP)
-				continue;
+	}
 
-			if (cmsg->cmsg_type == IP_TOS)
-			{
-				memcpy (&recv_qos, CMSG_DATA (cmsg),
-						sizeof (recv_qos));
-				dprintf ("TOSv4 = 0x%02"PRIx8";\n", recv_qos);
-			} else
-			if (cmsg->cmsg_type == IP_TTL)
-			{
-				memcpy (&recv_ttl, CMSG_DATA (cmsg),
-						sizeof (recv_ttl));
-				dprintf ("TTLv4 = %i;\n", recv_ttl);
-			}
-			else
-			{
-				dprintf ("Not handling option %i.\n",
-						cmsg->cmsg_type);
-			}
-		} /* }}} */
-		else if (addrfam == AF_INET6) /* {{{ */
+	if ((addrfamily == AF_UNSPEC) || (addrfamily == AF_INET6))
+	{
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+
+		if (inet_pton (AF_INET6, host, &sin6->sin6_addr) == 1)
 		{
-			if (cmsg->cmsg_level != IPPROTO_IPV6)
-				continue;
+			sin6->sin6_family = AF_INET6;
+			*ss_len = sizeof (*sin6);
+			return (0);
+		}
+	}
 
-			if (cmsg->cmsg_type == IPV6_TCLASS)
-			{
-				memcpy (&recv_qos, CMSG_DATA (cmsg),
-						sizeof (recv_qos));
-				dprintf ("TOSv6 = 0x%02"PRIx8";\n", recv_qos);
-			} else
-#ifdef IPV6_HOPLIMIT
-			if (cmsg->cmsg_type == IPV6_HOPLIMIT)
-			{
-				memcpy (&recv_ttl, CMSG_DATA (cmsg),
-						sizeof (recv_ttl));
-				dprintf ("TTLv6 = %i;\n", recv_ttl);
-			}
-			else
+	return (-1);
+}
+
+static void ping_host_resolve (struct pinghostquery *query)
+{
+	struct addrinfo ai_hints;
+
+	/* Address literals resolve to themselves; no lookup needed. */
+	if (ping_host_parse (query->host, query->addrfamily,
+				&query->addr, &query->addrlen) == 0)
+	{
+		query->numeric = 1;
+		return;
+	}
+
+	memset (&ai_hints, '\0', sizeof (ai_hints));
+	ai_hints.ai_flags     = 0;
+#ifdef AI_ADDRCONFIG
+	ai_hints.ai_flags    |= AI_ADDRCONFIG;
 #endif
-#ifdef IPV6_UNICAST_HOPS
-			if (cmsg->cmsg_type == IPV6_UNICAST_HOPS)
-			{
-				memcpy (&recv_ttl, CMSG_DATA (cmsg),
-						sizeof (recv_ttl));
-				dprintf ("TTLv6 = %i;\n", recv_ttl);
-			}
-			else
+#ifdef AI_CANONNAME
+	ai_hints.ai_flags    |= AI_CANONNAME;
 #endif
-#ifdef IPV6_MULTICAST_HOPS
-			if (cmsg->cmsg_type == IPV6_MULTICAST_HOPS)
-			{
-				memcpy (&recv_ttl, CMSG_DATA (cmsg),
-						sizeof (recv_ttl));
-				dprintf ("TTLv6 = %i;\n", recv_ttl);
-			}
-			else
+	ai_hints.ai_family    = query->addrfamily;
+	ai_hints.ai_socktype  = SOCK_RAW;
+
+	query->ai_list = NULL;
+	query->ai_return = getaddrinfo (query->host, NULL, &ai_hints,
+			&query->ai_list);
+	query->ai_errno = errno;
+}
+
+/* Resolves queries until there are none left; run by each thread of
+ * "ping_host_add_many". */
+struct pingresolver
+{
+#if PING_USE_THREADS
+	pthread_mutex_t          lock;
 #endif
-			{
-				dprintf ("Not handling option %i.\n",
-						cmsg->cmsg_type);
-			}
-		} /* }}} */
-		else
+	struct pinghostquery    *queries;
+	size_t                   queries_num;
+	size_t                   next;
+	/* Set once all queries are resolved, see "ping_refresh". */
+	int                      done;
+};
+
+static void *ping_resolver_run (void *arg)
+{
+	struct pingresolver *resolver = arg;
+
+	while (1)
+	{
+		size_t index;
+
+#if PING_USE_THREADS
+		pthread_mutex_lock (&resolver->lock);
+#endif
+		index = resolver->next;
+		if (index < resolver->queries_num)
+			resolver->next++;
+#if PING_USE_THREADS
+		pthread_mutex_unlock (&resolver->lock);
+#endif
+
+		if (index >= resolver->queries_num)
+			break;
+
+		if (!resolver->queries[index].skip)
+			ping_host_resolve (resolver->queries + index);
+	}
+
+	return (NULL);
+}
+
+/* ping_host_new returns a new host named "host", not yet added. If "host"
+ * is NULL, the host is named by its address, see "ping_host_name". */
+static pinghost_t *ping_host_new (pingobj_t *obj, const char *host)
+{
+	pinghost_t *ph;
+
+	if ((ph = ping_alloc (obj)) == NULL)
+	{
+		dprintf ("Out of memory!\n");
+		ping_set_errno (obj, errno);
+		return (NULL);
+	}
+
+	if (host != NULL)
+	{
+		struct pinghostext *ext = ping_host_ext (ph);
+
+		if ((ext == NULL) || ((ext->username = strdup (host)) == NULL))
 		{
-			dprintf ("Don't know how to handle "
-					"unknown protocol %i.\n",
-					cmsg->cmsg_level);
+			dprintf ("Out of memory!\n");
+			ping_set_errno (obj, errno);
+			ping_free (obj, ph);
+			return (NULL);
 		}
-	} /* }}} for (cmsg) */
 
-	if (addrfam == AF_INET)
+		ext->hostname = ext->username;
+	}
+
+	/* obj->data is not garuanteed to be != NULL */
+	if (obj->data == NULL)
+		obj->data = ping_data_new (PING_DEF_DATA,
+				strlen (PING_DEF_DATA));
+	if (obj->data == NULL)
 	{
-		host = ping_receive_ipv4 (obj, payload_buffer, payload_buffer_len);
-		if (host == NULL)
-			return (-1);
+		dprintf ("Out of memory!\n");
+		ping_set_errno (obj, errno);
+		ping_free (obj, ph);
+		return (NULL);
 	}
-	else if (addrfam == AF_INET6)
+	ph->data = ping_data_ref (obj->data);
+
+	return (ph);
+}
+
+/* ping_host_insert adds the new host "ph" to the object. On failure, "ph"
+ * is freed. */
+static int ping_host_insert (pingobj_t *obj, pinghost_t *ph)
+{
+	if (ping_slot_alloc (obj, ph) != 0)
 	{
-		host = ping_receive_ipv6 (obj, payload_buffer, payload_buffer_len);
-		if (host == NULL)
-			return (-1);
+		ping_free (obj, ph);
+		return (-1);
+	}
+
+	if (ping_addr_add (obj, ph) != 0)
+	{
+		ping_slot_free (obj, ph);
+		ping_free (obj, ph);
+		return (-1);
+	}
+
+	if (ping_name_add (obj, ph) != 0)
+	{
+		ping_addr_remove (obj, ph);
+		ping_slot_free (obj, ph);
+		ping_free (obj, ph);
+		return (-1);
+	}
+
+	ping_filter_update (obj);
+
+	/*
+	 * Adding in the front is much easier, but then the iterator will
+	 * return the host that was added last as first host. That's just not
+	 * nice. -octo
+	 */
+	ph->prev = obj->tail;
+	if (obj->tail == NULL)
+		obj->head = ph;
+	else
+		obj->tail->next = ph;
+	obj->tail = ph;
+	obj->hosts_num++;
+
+	if (obj->run_active)
+	{
+		/* Probe the new host right away. */
+		if (ping_clock_now (&ph->next_send) == -1)
+			ping_set_errno (obj, errno);
+		ph->due = ph->next_send;
+		ping_heap_insert (obj, ph);
 	}
+
+	return (0);
+} /* int ping_host_insert */
+
+/* ping_host_drop removes the host "ph" from the object and frees it. */
+static void ping_host_drop (pingobj_t *obj, pinghost_t *ph)
+{
+	if (ph->prev == NULL)
+		obj->head = ph->next;
 	else
+		ph->prev->next = ph->next;
+	if (ph->next == NULL)
+		obj->tail = ph->prev;
+	else
+		ph->next->prev = ph->prev;
+	obj->hosts_num--;
+
+	/* Don't leave the current round pointing to the removed host. */
+	if (obj->host_to_ping4 == ph)
+		obj->host_to_ping4 = ping_next_host (ph->next, AF_INET);
+	if (obj->host_to_ping6 == ph)
+		obj->host_to_ping6 = ping_next_host (ph->next, AF_INET6);
+	if (obj->refresh_next == ph)
+		obj->refresh_next = ph->next;
+	if (obj->round_active && (ph->pending > 0))
+		obj->pings_in_flight--;
+	ping_heap_remove (obj, ph);
+	ping_slot_free (obj, ph);
+	ping_addr_remove (obj, ph);
+	ping_name_remove (obj, ph);
+
+	/* The code that called the callback may still use the record. */
+	if (obj->callback_active)
+	{
+		ph->removed = 1;
+		ph->next = obj->hosts_removed;
+		obj->hosts_removed = ph;
+		return;
+	}
+
+	ping_free (obj, ph);
+} /* void ping_host_drop */
+
+/* ping_host_reap frees the hosts the callback has removed, see
+ * "ping_host_notify". */
+static void ping_host_reap (pingobj_t *obj)
+{
+	while (obj->hosts_removed != NULL)
+	{
+		pinghost_t *ph = obj->hosts_removed;
+
+		obj->hosts_removed = ph->next;
+		ping_free (obj, ph);
+	}
+}
+
+/* ping_host_add_sockaddr adds the host "host" with the IPv4 or IPv6
+ * address "addr". If "host" is NULL, the host is named by its address, see
+ * "ping_host_name". */
+static int ping_host_add_sockaddr (pingobj_t *obj, const char *host,
+		const struct sockaddr *addr, socklen_t addrlen)
+{
+	pinghost_t *ph;
+
+	if ((ph = ping_host_new (obj, host)) == NULL)
+		return (-1);
+
+	memcpy (&ph->addr, addr, addrlen);
+	ph->addrlen = addrlen;
+	ph->addrfamily = addr->sa_family;
+
+	return (ping_host_insert (obj, ph));
+}
+
+/* ping_host_add_all adds a host named "host" for each IPv4 and IPv6 address
+ * in "ai_list" that no host of that name has yet. This is what
+ * PING_OPT_ALL_ADDRESSES does instead of keeping the last address only.
+ * Returns the number of hosts added, or less than zero on error. */
+static int ping_host_add_all (pingobj_t *obj, const char *host,
+		const struct addrinfo *ai_list, const struct timespec *now)
+{
+	const struct addrinfo *ai_ptr;
+	const char *canonname = NULL;
+	int added = 0;
+
+#ifdef AI_CANONNAME
+	/* Only the first entry carries the canonical name. */
+	if ((ai_list != NULL) && (ai_list->ai_canonname != NULL)
+			&& (strcmp (host, ai_list->ai_canonname) != 0))
+		canonname = ai_list->ai_canonname;
+#endif
+
+	for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+	{
+		pinghost_t *ph;
+
+		if (((ai_ptr->ai_family != AF_INET)
+					&& (ai_ptr->ai_family != AF_INET6))
+				|| (ai_ptr->ai_addrlen > sizeof (ph->addr)))
+			continue;
+
+		/* Also skips addresses getaddrinfo(3) returned twice. */
+		for (ph = ping_name_lookup (obj, host); ph != NULL;
+				ph = ping_name_next (ph))
+			if (ping_addr_equal (&ph->addr.sa, ai_ptr->ai_addr))
+				break;
+		if (ph != NULL)
+			continue;
+
+		if ((ph = ping_host_new (obj, host)) == NULL)
+			return (-1);
+
+		memcpy (&ph->addr, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+		ph->addrlen = ai_ptr->ai_addrlen;
+		ph->addrfamily = ai_ptr->ai_family;
+		ph->ext->resolve = 1;
+		ph->ext->resolve_all = 1;
+		ph->ext->resolved = *now;
+
+		if ((canonname != NULL) && ((ph->ext->hostname
+						= strdup (canonname)) == NULL))
+			/* strdup failed, falling back to the user's name */
+			ph->ext->hostname = ph->ext->username;
+
+		if (ping_host_insert (obj, ph) != 0)
+			return (-1);
+		added++;
+	}
+
+	return (added);
+} /* int ping_host_add_all */
+
+/* ping_host_add_resolved adds the host of "query". The caller frees the
+ * result of the query. */
+static int ping_host_add_resolved (pingobj_t *obj,
+		struct pinghostquery *query)
+{
+	const char *host = query->host;
+	pinghost_t *ph;
+	struct pinghostext *ext;
+
+	struct addrinfo *ai_list, *ai_ptr;
+	int              ai_return;
+	struct timespec  now;
+
+	dprintf ("host = %s\n", host);
+
+	if (ping_name_lookup (obj, host) != NULL)
+		return (0);
+
+	if (query->numeric)
+		return (ping_host_add_sockaddr (obj, host,
+					(struct sockaddr *) &query->addr,
+					query->addrlen));
+
+	ai_list = query->ai_list;
+	if ((ai_return = query->ai_return) != 0)
 	{
-		dprintf ("ping_receive_one: Unknown address family %i.\n",
-				addrfam);
+#if defined(EAI_SYSTEM)
+		char errbuf[PING_ERRMSG_LEN];
+#endif
+		dprintf ("getaddrinfo failed\n");
+		ping_set_error (obj, "getaddrinfo",
+#if defined(EAI_SYSTEM)
+				(ai_return == EAI_SYSTEM)
+				? sstrerror (query->ai_errno, errbuf,
+					sizeof (errbuf)) :
+#endif
+				gai_strerror (ai_return));
 		return (-1);
 	}
 
-	dprintf ("rcvd: %12i.%06i\n",
-			(int) pkt_now.tv_sec,
-			(int) pkt_now.tv_usec);
-	dprintf ("sent: %12i.%06i\n",
-			(int) host->timer->tv_sec,
-			(int) host->timer->tv_usec);
+	/* Resolved again with PING_OPT_RESOLVE_TTL, see "ping_refresh". */
+	if (ping_clock_now (&now) == -1)
+		ping_timespec_clear (&now);
 
-	if (ping_timeval_sub (&pkt_now, host->timer, &diff) < 0)
+	if (obj->all_addresses)
 	{
-		timerclear (host->timer);
-		return (-1);
+		int status = ping_host_add_all (obj, host, ai_list, &now);
+
+		if (status == 0)
+			ping_set_error (obj, "getaddrinfo",
+					"No hosts returned");
+		return ((status > 0) ? 0 : -1);
 	}
 
-	dprintf ("diff: %12i.%06i\n",
-			(int) diff.tv_sec,
-			(int) diff.tv_usec);
+	if ((ph = ping_host_new (obj, host)) == NULL)
+		return (-1);
 
-	if (recv_ttl >= 0)
-		host->recv_ttl = recv_ttl;
-	host->recv_qos = recv_qos;
+	ext = ph->ext;
+	ext->resolve = 1;
+	ext->resolved = now;
+
+	if (ai_list == NULL)
+		ping_set_error (obj, "getaddrinfo", "No hosts returned");
+
+	for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+	{
+		if (ai_ptr->ai_family == AF_INET)
+		{
+			ai_ptr->ai_socktype = SOCK_RAW;
+			ai_ptr->ai_protocol = IPPROTO_ICMP;
+		}
+		else if (ai_ptr->ai_family == AF_INET6)
+		{
+			ai_ptr->ai_socktype = SOCK_RAW;
+			ai_ptr->ai_protocol = IPPROTO_ICMPV6;
+		}
+		else
+		{
+			char errmsg[PING_ERRMSG_LEN];
 
-	host->latency  = ((double) diff.tv_usec) / 1000.0;
-	host->latency += ((double) diff.tv_sec)  * 1000.0;
+			snprintf (errmsg, PING_ERRMSG_LEN,
+					"Unknown `ai_family': %i",
+					ai_ptr->ai_family);
+			errmsg[PING_ERRMSG_LEN - 1] = '\0';
 
-	timerclear (host->timer);
+			dprintf ("%s", errmsg);
+			ping_set_error (obj, "getaddrinfo", errmsg);
+			continue;
+		}
 
-	return (0);
-}
+		assert (sizeof (ph->addr) >= ai_ptr->ai_addrlen);
+		memset (&ph->addr, '\0', sizeof (ph->addr));
+		memcpy (&ph->addr, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+		ph->addrlen = ai_ptr->ai_addrlen;
+		ph->addrfamily = ai_ptr->ai_family;
+
+#ifdef AI_CANONNAME
+		if ((ai_ptr->ai_canonname != NULL)
+				&& (strcmp (ext->hostname,
+						ai_ptr->ai_canonname) != 0))
+		{
+			char *old_hostname;
+
+			dprintf ("ph->hostname = %s; ai_ptr->ai_canonname = %s;\n",
+					ext->hostname, ai_ptr->ai_canonname);
+
+			old_hostname = ext->hostname;
+			ext->hostname = strdup (ai_ptr->ai_canonname);
+			if (ext->hostname == NULL)
+			{
+				/* strdup failed, falling back to old hostname */
+				ext->hostname = old_hostname;
+			}
+			else if (old_hostname != ext->username)
+			{
+				free (old_hostname);
+			}
+		}
+#endif /* AI_CANONNAME */
+	} /* for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next) */
+
+	return (ping_host_insert (obj, ph));
+} /* int ping_host_add_resolved */
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Sending functions:                                                        *
+ * Address ranges:                                                           *
  *                                                                           *
- * ping_send_all                                                             *
- * +-> ping_send_one_ipv4                                                    *
- * `-> ping_send_one_ipv6                                                    *
+ * "ping_host_add_range" adds every address of a prefix or a range. The      *
+ * addresses are counted up as 16 byte big endian numbers, the IPv4 ones in  *
+ * the last four bytes, and each becomes a host without a name string: the   *
+ * name is the address in its usual notation, formatted when needed, see    *
+ * "ping_host_name".                                                         *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-static ssize_t ping_sendto (pingobj_t *obj, pinghost_t *ph,
-		const void *buf, size_t buflen, int fd)
+struct pingrange
 {
-	ssize_t ret;
+	int                      addrfamily;
+	uint8_t                  first[16];
+	uint8_t                  last[16];
+};
+
+/* Parses an IPv4 or IPv6 address into the 16 byte number "num". */
+static int ping_range_parse_addr (const char *str, int *addrfamily,
+		uint8_t *num)
+{
+	memset (num, 0, 16);
 
-	if (gettimeofday (ph->timer, NULL) == -1)
+	if (inet_pton (AF_INET6, str, num) == 1)
 	{
-		timerclear (ph->timer);
-		return (-1);
+		*addrfamily = AF_INET6;
+		return (0);
 	}
 
-	ret = sendto (fd, buf, buflen, 0,
-			(struct sockaddr *) ph->addr, ph->addrlen);
-
-	if (ret < 0)
+	if (inet_pton (AF_INET, str, num + 12) == 1)
 	{
-#if defined(EHOSTUNREACH)
-		if (errno == EHOSTUNREACH)
-			return (0);
-#endif
-#if defined(ENETUNREACH)
-		if (errno == ENETUNREACH)
-			return (0);
-#endif
-		/* BSDs return EHOSTDOWN on ARP/ND failure */
-#if defined(EHOSTDOWN)
-		if (errno == EHOSTDOWN)
-			return (0);
-#endif
-		ping_set_errno (obj, errno);
+		*addrfamily = AF_INET;
+		return (0);
 	}
 
-	return (ret);
+	return (-1);
 }
 
-static int ping_send_one_ipv4 (pingobj_t *obj, pinghost_t *ph, int fd)
+/* ping_range_parse parses "address/prefix-length" or "first-last". IPv4
+ * prefixes shorter than 31 bits leave out their network and broadcast
+ * addresses. */
+static int ping_range_parse (const char *str, struct pingrange *range)
 {
-	struct icmp *icmp4;
-	int status;
+	char buffer[2 * INET6_ADDRSTRLEN + 2];
+	char *sep;
 
-	char   buf[4096] = {0};
-	size_t buflen;
+	if (strlen (str) >= sizeof (buffer))
+		return (-1);
+	strcpy (buffer, str);
 
-	char *data;
-	size_t datalen;
+	if ((sep = strchr (buffer, '/')) != NULL)
+	{
+		char *endptr = NULL;
+		unsigned long prefix;
+		unsigned long bits;
+		size_t i;
+
+		*sep = 0;
+		if (ping_range_parse_addr (buffer, &range->addrfamily,
+					range->first) != 0)
+			return (-1);
 
-	dprintf ("ph->hostname = %s\n", ph->hostname);
+		bits = (range->addrfamily == AF_INET) ? 32 : 128;
+		errno = 0;
+		prefix = strtoul (sep + 1, &endptr, 10);
+		if ((errno != 0) || (endptr == sep + 1) || (*endptr != 0)
+				|| (prefix > bits))
+			return (-1);
+		prefix += 128 - bits;
 
-	icmp4 = (struct icmp *) buf;
-	*icmp4 = (struct icmp) {
-		.icmp_type = ICMP_ECHO,
-		.icmp_id   = htons (ph->ident),
-		.icmp_seq  = htons (ph->sequence),
-	};
+		/* Clear the host bits of "first", set those of "last". */
+		for (i = 0; i < 16; i++)
+		{
+			uint8_t mask;
 
-	datalen = strlen (ph->data);
-	buflen = ICMP_MINLEN + datalen;
-	if (sizeof (buf) < buflen)
-		return (EINVAL);
+			if (prefix >= 8 * (i + 1))
+				mask = 0xFF;
+			else if (prefix <= 8 * i)
+				mask = 0;
+			else
+				mask = (uint8_t) (0xFF
+						<< (8 * (i + 1) - prefix));
 
-	data  = buf + ICMP_MINLEN;
-	memcpy (data, ph->data, datalen);
+			range->first[i] &= mask;
+			range->last[i] = range->first[i] | (uint8_t) ~mask;
+		}
 
-	icmp4->icmp_cksum = ping_icmp4_checksum (buf, buflen);
+		if ((range->addrfamily == AF_INET) && (prefix < 128 - 1))
+		{
+			range->first[15]++;
+			range->last[15]--;
+		}
 
-	dprintf ("Sending ICMPv4 package with ID 0x%04x\n", ph->ident);
+		return (0);
+	}
 
-	status = ping_sendto (obj, ph, buf, buflen, fd);
-	if (status < 0)
+	if ((sep = strchr (buffer, '-')) != NULL)
 	{
-		perror ("ping_sendto");
-		return (-1);
-	}
+		int addrfamily;
+
+		*sep = 0;
+		if ((ping_range_parse_addr (buffer, &range->addrfamily,
+						range->first) != 0)
+				|| (ping_range_parse_addr (sep + 1, &addrfamily,
+						range->last) != 0)
+				|| (addrfamily != range->addrfamily)
+				|| (memcmp (range->first, range->last, 16) > 0))
+			return (-1);
 
-	dprintf ("sendto: status = %i\n", status);
+		return (0);
+	}
 
-	return (0);
+	return (-1);
 }
 
-static int ping_send_one_ipv6 (pingobj_t *obj, pinghost_t *ph, int fd)
+/* Returns the number of addresses in "range", or SIZE_MAX if there are more
+ * than PING_MAX_SLOTS. */
+static size_t ping_range_size (const struct pingrange *range)
 {
-	struct icmp6_hdr *icmp6;
-	int status;
+	uint8_t diff[16];
+	unsigned int borrow = 0;
+	size_t num = 0;
+	int i;
+
+	for (i = 15; i >= 0; i--)
+	{
+		unsigned int d = (unsigned int) range->last[i]
+			- (unsigned int) range->first[i] - borrow;
 
-	char buf[4096] = {0};
-	int  buflen;
+		diff[i] = (uint8_t) d;
+		borrow = (d > 0xFF) ? 1 : 0;
+	}
 
-	char *data;
-	int   datalen;
+	for (i = 0; i < 16; i++)
+	{
+		if (num > (PING_MAX_SLOTS >> 8))
+			return (SIZE_MAX);
+		num = (num << 8) | diff[i];
+	}
 
-	dprintf ("ph->hostname = %s\n", ph->hostname);
+	if (num >= PING_MAX_SLOTS)
+		return (SIZE_MAX);
 
-	icmp6 = (struct icmp6_hdr *) buf;
-	*icmp6 = (struct icmp6_hdr) {
-		.icmp6_type  = ICMP6_ECHO_REQUEST,
-		.icmp6_id    = htons (ph->ident),
-		.icmp6_seq   = htons (ph->sequence),
-	};
+	return (num + 1);
+}
 
-	datalen = strlen (ph->data);
-	buflen = sizeof (*icmp6) + datalen;
-	if (sizeof (buf) < buflen)
-		return (EINVAL);
+static void ping_range_next (uint8_t *num)
+{
+	int i;
 
-	data  = buf + ICMP_MINLEN;
-	memcpy (data, ph->data, datalen);
+	for (i = 15; i >= 0; i--)
+		if (++num[i] != 0)
+			break;
+}
 
-	/* The checksum will be calculated by the TCP/IP stack. */
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Resolver cache:                                                           *
+ *                                                                           *
+ * With PING_OPT_RESOLVE_TTL, hosts added by name remember when they were    *
+ * resolved and are resolved again once that is longer than the TTL ago, so  *
+ * a long running object follows address changes. getaddrinfo(3) does not    *
+ * report the TTL of the DNS records, so one TTL is used for all hosts.      *
+ *                                                                           *
+ * "ping_refresh" runs at the start of each round and each step of           *
+ * continuous mode. It looks at up to PING_REFRESH_SCAN hosts, from where it *
+ * stopped last time, and hands up to PING_REFRESH_MAX expired ones to a     *
+ * thread, which resolves them while the object keeps pinging. A later call  *
+ * applies the results: a changed address replaces the host's address in     *
+ * place, in the address index, too. The host keeps its slot, and so its     *
+ * ident, and its address family. Hosts added with PING_OPT_ALL_ADDRESSES    *
+ * are resolved once per name and follow the new set of addresses: hosts are *
+ * added for new addresses and removed for vanished ones. Without threads,   *
+ * the expired hosts are resolved right away, blocking the call.             *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define PING_REFRESH_SCAN 64
+#define PING_REFRESH_MAX  8
 
-	dprintf ("Sending ICMPv6 package with ID 0x%04x\n", ph->ident);
+static struct pingresolver *ping_refresh_new (size_t num)
+{
+	struct pingresolver *resolver;
 
-	status = ping_sendto (obj, ph, buf, buflen, fd);
-	if (status < 0)
+	resolver = calloc (1, sizeof (*resolver));
+	if (resolver == NULL)
+		return (NULL);
+
+	resolver->queries = calloc (num, sizeof (*resolver->queries));
+	if (resolver->queries == NULL)
 	{
-		perror ("ping_sendto");
-		return (-1);
+		free (resolver);
+		return (NULL);
 	}
 
-	dprintf ("sendto: status = %i\n", status);
+#if PING_USE_THREADS
+	pthread_mutex_init (&resolver->lock, /* attr = */ NULL);
+#endif
 
-	return (0);
+	return (resolver);
 }
 
-static int ping_send_one (pingobj_t *obj, pinghost_t *ptr, int fd)
+static void ping_refresh_free (struct pingresolver *resolver)
 {
-	if (gettimeofday (ptr->timer, NULL) == -1)
-	{
-		/* start timer.. The GNU `ping6' starts the timer before
-		 * sending the packet, so I will do that too */
-#if WITH_DEBUG
-		char errbuf[PING_ERRMSG_LEN];
-		dprintf ("gettimeofday: %s\n",
-				sstrerror (errno, errbuf, sizeof (errbuf)));
-#endif
-		timerclear (ptr->timer);
-		return (-1);
-	}
-	else
-	{
-		dprintf ("timer set for hostname = %s\n", ptr->hostname);
-	}
+	size_t i;
 
-	if (ptr->addrfamily == AF_INET6)
-	{
-		dprintf ("Sending ICMPv6 echo request to `%s'\n", ptr->hostname);
-		if (ping_send_one_ipv6 (obj, ptr, fd) != 0)
-		{
-			timerclear (ptr->timer);
-			return (-1);
-		}
-	}
-	else if (ptr->addrfamily == AF_INET)
+	for (i = 0; i < resolver->queries_num; i++)
 	{
-		dprintf ("Sending ICMPv4 echo request to `%s'\n", ptr->hostname);
-		if (ping_send_one_ipv4 (obj, ptr, fd) != 0)
-		{
-			timerclear (ptr->timer);
-			return (-1);
-		}
-	}
-	else /* this should not happen */
-	{
-		dprintf ("Unknown address family: %i\n", ptr->addrfamily);
-		timerclear (ptr->timer);
-		return (-1);
-	}
+		struct pinghostquery *query = resolver->queries + i;
 
-	ptr->sequence++;
+		if (query->ai_list != NULL)
+			freeaddrinfo (query->ai_list);
+		free ((char *) query->host);
+	}
 
-	return (0);
+#if PING_USE_THREADS
+	pthread_mutex_destroy (&resolver->lock);
+#endif
+	free (resolver->queries);
+	free (resolver);
 }
 
-/*
- * Set the TTL of a socket protocol independently.
- */
-static int ping_set_ttl (pingobj_t *obj, int ttl)
+#if PING_USE_THREADS
+static void *ping_refresh_run (void *arg)
 {
-	int ret = 0;
-	char errbuf[PING_ERRMSG_LEN];
+	struct pingresolver *resolver = arg;
 
-	if (obj->fd4 != -1)
-	{
-		if (setsockopt (obj->fd4, IPPROTO_IP, IP_TTL,
-				&ttl, sizeof (ttl)))
-		{
-			ret = errno;
-			ping_set_error (obj, "ping_set_ttl",
-					sstrerror (ret, errbuf, sizeof (errbuf)));
-			dprintf ("Setting TTLv4 failed: %s\n", errbuf);
-		}
-	}
+	ping_resolver_run (resolver);
 
-	if (obj->fd6 != -1)
-	{
-		dprintf ("Setting TTLv6 to %i\n", ttl);
-		if (setsockopt (obj->fd6, IPPROTO_IPV6, IPV6_UNICAST_HOPS,
-				&ttl, sizeof (ttl)))
-		{
-			ret = errno;
-			ping_set_error (obj, "ping_set_ttl",
-					sstrerror (ret, errbuf, sizeof (errbuf)));
-			dprintf ("Setting TTLv6 failed: %s\n", errbuf);
-		}
-	}
+	pthread_mutex_lock (&resolver->lock);
+	resolver->done = 1;
+	pthread_mutex_unlock (&resolver->lock);
 
-	return (ret);
+	return (NULL);
 }
+#endif
 
-/*
- * Set the TOS of a socket protocol independently.
- *
- * Using SOL_SOCKET / SO_PRIORITY might be a protocol independent way to
- * set this. See socket(7) for details.
- */
-static int ping_set_qos (pingobj_t *obj, uint8_t qos)
+/* ping_refresh_apply_all updates the hosts of a name added with
+ * PING_OPT_ALL_ADDRESSES, "ph" being one of them, to the addresses in
+ * "query". Hosts added and removed are reported to the host callback, so
+ * the caller can set up and free their contexts. */
+static void ping_refresh_apply_all (pingobj_t *obj, pinghost_t *ph,
+		struct pinghostquery *query, struct timespec *now)
 {
-	int ret = 0;
-	char errbuf[PING_ERRMSG_LEN];
+	const struct addrinfo *ai_ptr;
+	pinghost_t *next;
+	pinghost_t *last;
+	int status;
 
-	if (obj->fd4 != -1)
+	for (next = ph; next != NULL; next = ping_name_next (next))
+		if (next->ext != NULL)
+			next->ext->resolved = *now;
+
+	if (query->ai_return != 0)
 	{
-		dprintf ("Setting TP_TOS to %#04"PRIx8"\n", qos);
-		if (setsockopt (obj->fd4, IPPROTO_IP, IP_TOS,
-				&qos, sizeof (qos)))
-		{
-			ret = errno;
-			ping_set_error (obj, "ping_set_qos",
-					sstrerror (ret, errbuf, sizeof (errbuf)));
-			dprintf ("Setting TP_TOS failed: %s\n", errbuf);
-		}
+		dprintf ("Resolving %s failed: %s\n", query->host,
+				gai_strerror (query->ai_return));
+		return;
 	}
 
-	if (obj->fd6 != -1)
+	/* Keep the old addresses if there are no new ones. */
+	for (ai_ptr = query->ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+		if ((ai_ptr->ai_family == AF_INET)
+				|| (ai_ptr->ai_family == AF_INET6))
+			break;
+	if (ai_ptr == NULL)
+		return;
+
+	/* Add hosts for new addresses first, so the name keeps its hosts if
+	 * that fails. They are appended to the list. */
+	last = obj->tail;
+	status = ping_host_add_all (obj, query->host, query->ai_list, now);
+
+	if (obj->host_callback != NULL)
+		for (ph = (last != NULL) ? last->next : obj->head; ph != NULL;
+				ph = ph->next)
+			(*obj->host_callback) (obj, ph, PING_HOST_ADDED,
+					obj->host_callback_arg);
+
+	if (status < 0)
+		return;
+
+	for (ph = ping_name_lookup (obj, query->host); ph != NULL; ph = next)
 	{
-		/* IPV6_TCLASS requires an "int". */
-		int tmp = (int) qos;
+		next = ping_name_next (ph);
 
-		dprintf ("Setting IPV6_TCLASS to %#04"PRIx8" (%i)\n", qos, tmp);
-		if (setsockopt (obj->fd6, IPPROTO_IPV6, IPV6_TCLASS,
-			&tmp, sizeof (tmp)))
+		for (ai_ptr = query->ai_list; ai_ptr != NULL;
+				ai_ptr = ai_ptr->ai_next)
+			if ((ai_ptr->ai_family == ph->addrfamily)
+					&& ping_addr_equal (&ph->addr.sa,
+						ai_ptr->ai_addr))
+				break;
+
+		if (ai_ptr == NULL)
 		{
-			ret = errno;
-			ping_set_error (obj, "ping_set_qos",
-					sstrerror (ret, errbuf, sizeof (errbuf)));
-			dprintf ("Setting IPV6_TCLASS failed: %s\n", errbuf);
+			dprintf ("An address of %s vanished\n", query->host);
+			if (obj->host_callback != NULL)
+				(*obj->host_callback) (obj, ph,
+						PING_HOST_REMOVED,
+						obj->host_callback_arg);
+			ping_host_drop (obj, ph);
 		}
 	}
+} /* void ping_refresh_apply_all */
 
-	return (ret);
-}
-
-static int ping_get_ident (void)
+/* ping_refresh_apply updates the hosts resolved by "resolver". Hosts removed
+ * in the meantime are skipped. */
+static void ping_refresh_apply (pingobj_t *obj,
+		struct pingresolver *resolver, struct timespec *now)
 {
-	int fd;
-	static int did_seed = 0;
-
-	int retval;
+	size_t i;
 
-	if (did_seed == 0)
+	for (i = 0; i < resolver->queries_num; i++)
 	{
-		if ((fd = open ("/dev/urandom", O_RDONLY)) != -1)
-		{
-			unsigned int seed;
+		struct pinghostquery *query = resolver->queries + i;
+		struct addrinfo *ai_ptr, *ai_found = NULL;
+		pinghost_t *ph;
 
-			if (read (fd, &seed, sizeof (seed)) != -1)
-			{
-				did_seed = 1;
-				dprintf ("Random seed:   %#x\n", seed);
-				srandom (seed);
-			}
+		ph = ping_name_lookup (obj, query->host);
+		if ((ph == NULL) || (ph->ext == NULL) || !ph->ext->resolve)
+			continue;
 
-			close (fd);
+		if (ph->ext->resolve_all)
+		{
+			ping_refresh_apply_all (obj, ph, query, now);
+			continue;
 		}
-#if WITH_DEBUG
-		else
+
+		/* Try again after another TTL if the lookup failed. */
+		ph->ext->resolved = *now;
+		if (query->ai_return != 0)
 		{
-			char errbuf[PING_ERRMSG_LEN];
-			dprintf ("open (/dev/urandom): %s\n",
-					sstrerror (errno, errbuf, sizeof (errbuf)));
+			dprintf ("Resolving %s failed: %s\n", query->host,
+					gai_strerror (query->ai_return));
+			continue;
 		}
-#endif
+
+		/* Like "ping_host_add_resolved", use the last address. */
+		for (ai_ptr = query->ai_list; ai_ptr != NULL;
+				ai_ptr = ai_ptr->ai_next)
+			if ((ai_ptr->ai_family == ph->addrfamily)
+					&& (ai_ptr->ai_addrlen
+						<= sizeof (ph->addr)))
+				ai_found = ai_ptr;
+
+		if ((ai_found == NULL) || ping_addr_equal (&ph->addr.sa,
+					ai_found->ai_addr))
+			continue;
+
+		dprintf ("Address of %s changed\n", query->host);
+
+		ping_addr_remove (obj, ph);
+		memset (&ph->addr, '\0', sizeof (ph->addr));
+		memcpy (&ph->addr, ai_found->ai_addr, ai_found->ai_addrlen);
+		ph->addrlen = ai_found->ai_addrlen;
+		/* Doesn't fail: the index already has room for this host. */
+		ping_addr_add (obj, ph);
 	}
+}
 
-	retval = (int) random ();
+/* ping_refresh_add adds a query for the name of "ph" to "*resolver", which
+ * is allocated first if it is NULL. Hosts added for all addresses of a name
+ * share one query. Returns less than zero if memory is short. */
+static int ping_refresh_add (pingobj_t *obj, struct pingresolver **resolver,
+		pinghost_t *ph)
+{
+	struct pingresolver *res = *resolver;
+	struct pinghostquery *query;
+	size_t i;
 
-	dprintf ("Random number: %#x\n", retval);
+	if (res == NULL)
+	{
+		res = ping_refresh_new (PING_REFRESH_MAX);
+		if (res == NULL)
+			return (-1);
+		*resolver = res;
+	}
 
-	return (retval);
+	for (i = 0; i < res->queries_num; i++)
+		if (strcasecmp (res->queries[i].host, ph->ext->username) == 0)
+			return (0);
+
+	query = res->queries + res->queries_num;
+	query->addrfamily = ph->ext->resolve_all
+		? obj->addrfamily : ph->addrfamily;
+	query->host = strdup (ph->ext->username);
+	if (query->host == NULL)
+		return (-1);
+	res->queries_num++;
+
+	return (0);
 }
 
-static pinghost_t *ping_alloc (void)
+static void ping_refresh (pingobj_t *obj, struct timespec *now)
 {
+	struct pingresolver *resolver;
+	struct timespec ttl;
 	pinghost_t *ph;
-	size_t      ph_size;
+	size_t i;
 
-	ph_size = sizeof (pinghost_t)
-		+ sizeof (struct sockaddr_storage)
-		+ sizeof (struct timeval);
+	if (obj->refresh != NULL)
+	{
+#if PING_USE_THREADS
+		int done;
 
-	ph = (pinghost_t *) malloc (ph_size);
-	if (ph == NULL)
-		return (NULL);
+		pthread_mutex_lock (&obj->refresh->lock);
+		done = obj->refresh->done;
+		pthread_mutex_unlock (&obj->refresh->lock);
+		if (!done)
+			return;
 
-	memset (ph, '\0', ph_size);
+		pthread_join (obj->refresh_thread, /* retval = */ NULL);
+#endif
+		ping_refresh_apply (obj, obj->refresh, now);
+		ping_refresh_free (obj->refresh);
+		obj->refresh = NULL;
+	}
 
-	ph->timer   = (struct timeval *) (ph + 1);
-	ph->addr    = (struct sockaddr_storage *) (ph->timer + 1);
+	if ((obj->resolve_ttl <= 0.0) || (obj->head == NULL))
+		return;
 
-	ph->addrlen = sizeof (struct sockaddr_storage);
-	ph->latency = -1.0;
-	ph->dropped = 0;
-	ph->ident   = ping_get_ident () & 0xFFFF;
+	resolver = NULL;
+	ping_timespec_set (&ttl, obj->resolve_ttl);
+	ph = (obj->refresh_next != NULL) ? obj->refresh_next : obj->head;
+	for (i = 0; (i < PING_REFRESH_SCAN) && (i < obj->hosts_num); i++)
+	{
+		struct pinghostext *ext = ph->ext;
+		struct timespec expires;
 
-	return (ph);
-}
+		if ((ext != NULL) && ext->resolve)
+		{
+			ping_timespec_add (&ext->resolved, &ttl, &expires);
+			if ((ping_timespec_cmp (now, &expires) >= 0)
+					&& (ping_refresh_add (obj, &resolver,
+							ph) != 0))
+				break;
+		}
 
-static void ping_free (pinghost_t *ph)
-{
-	if (ph == NULL)
+		ph = (ph->next != NULL) ? ph->next : obj->head;
+		if ((resolver != NULL)
+				&& (resolver->queries_num >= PING_REFRESH_MAX))
+			break;
+	}
+	obj->refresh_next = ph;
+
+	if (resolver == NULL)
 		return;
 
-	free (ph->username);
-	free (ph->hostname);
-	free (ph->data);
+	if (resolver->queries_num == 0)
+	{
+		ping_refresh_free (resolver);
+		return;
+	}
+
+#if PING_USE_THREADS
+	if (pthread_create (&obj->refresh_thread, /* attr = */ NULL,
+				ping_refresh_run, resolver) == 0)
+	{
+		obj->refresh = resolver;
+		return;
+	}
+#endif
 
-	free (ph);
+	ping_resolver_run (resolver);
+	ping_refresh_apply (obj, resolver, now);
+	ping_refresh_free (resolver);
 }
 
-/* ping_open_socket opens, initializes and returns a new raw socket to use for
- * ICMPv4 or ICMPv6 packets. addrfam must be either AF_INET or AF_INET6. On
- * error, -1 is returned and obj->errmsg is set appropriately. */
+/* ping_open_socket opens, initializes and returns a new raw socket, or ping
+ * socket with PING_OPT_DGRAM, to use for ICMPv4 or ICMPv6 packets. addrfam
+ * must be either AF_INET or AF_INET6. On error, -1 is returned and
+ * obj->errmsg is set appropriately. */
 static int ping_open_socket(pingobj_t *obj, int addrfam)
 {
 	int fd;
+	int type = obj->dgram ? SOCK_DGRAM : SOCK_RAW;
 	if (addrfam == AF_INET6)
 	{
-		fd = socket(addrfam, SOCK_RAW, IPPROTO_ICMPV6);
+		fd = socket(addrfam, type, IPPROTO_ICMPV6);
 	}
 	else if (addrfam == AF_INET)
 	{
-		fd = socket(addrfam, SOCK_RAW, IPPROTO_ICMP);
+		fd = socket(addrfam, type, IPPROTO_ICMP);
 	}
 	else /* this should not happen */
 	{
@@ -1003,12 +4333,15 @@ static int ping_open_socket(pingobj_t *obj, int addrfam)
 #endif
 		return -1;
 	}
-	else if (fd >= FD_SETSIZE)
+
+	if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) != 0)
 	{
-		ping_set_errno (obj, EMFILE);
-		dprintf ("socket(2) returned file descriptor %d, which is above the file "
-			 "descriptor limit for select(2) (FD_SETSIZE = %d)\n",
-			 fd, FD_SETSIZE);
+		ping_set_errno (obj, errno);
+#if WITH_DEBUG
+		char errbuf[PING_ERRMSG_LEN];
+		dprintf ("fcntl (O_NONBLOCK): %s\n",
+				sstrerror (errno, errbuf, sizeof (errbuf)));
+#endif
 		close (fd);
 		return -1;
 	}
@@ -1065,54 +4398,490 @@ static int ping_open_socket(pingobj_t *obj, int addrfam)
 		}
 	}
 #endif
-#ifdef SO_TIMESTAMP
+#ifdef PING_SO_TIMESTAMP
 	if (1) /* {{{ */
 	{
-		int status = setsockopt (fd, SOL_SOCKET, SO_TIMESTAMP,
+		int status = setsockopt (fd, SOL_SOCKET, PING_SO_TIMESTAMP,
 		                         &(int){1}, sizeof(int));
 		if (status != 0)
 		{
-			ping_set_errno (obj, errno);
-#if WITH_DEBUG
-			char errbuf[PING_ERRMSG_LEN];
-			dprintf ("setsockopt (SO_TIMESTAMP): %s\n",
-					sstrerror (errno, errbuf, sizeof (errbuf)));
-#endif
-			close (fd);
-			return -1;
+			ping_set_errno (obj, errno);
+#if WITH_DEBUG
+			char errbuf[PING_ERRMSG_LEN];
+			dprintf ("setsockopt (SO_TIMESTAMP): %s\n",
+					sstrerror (errno, errbuf, sizeof (errbuf)));
+#endif
+			close (fd);
+			return -1;
+		}
+	} /* }}} if (1) */
+#endif /* PING_SO_TIMESTAMP */
+	/* Receive timestamps are provided by PING_SO_TIMESTAMP. */
+	ping_tx_setup (obj, fd, addrfam);
+
+	if (addrfam == AF_INET)
+	{
+#ifdef IP_RECVTOS
+		/* Enable receiving the TOS field */
+		setsockopt (fd, IPPROTO_IP, IP_RECVTOS, &(int){1}, sizeof(int));
+#endif /* IP_RECVTOS */
+
+		/* Enable receiving the TTL field */
+		setsockopt (fd, IPPROTO_IP, IP_RECVTTL, &(int){1}, sizeof(int));
+	}
+#if defined(IPV6_RECVHOPLIMIT) || defined(IPV6_RECVTCLASS)
+	else if (addrfam == AF_INET6)
+	{
+# if defined(IPV6_RECVHOPLIMIT)
+		/* For details see RFC 3542, section 6.3. */
+		setsockopt (fd, IPPROTO_IPV6, IPV6_RECVHOPLIMIT,
+		            &(int){1}, sizeof(int));
+# endif /* IPV6_RECVHOPLIMIT */
+
+# if defined(IPV6_RECVTCLASS)
+		/* For details see RFC 3542, section 6.5. */
+		setsockopt (fd, IPPROTO_IPV6, IPV6_RECVTCLASS,
+		            &(int){1}, sizeof(int));
+# endif /* IPV6_RECVTCLASS */
+	}
+#endif /* IPV6_RECVHOPLIMIT || IPV6_RECVTCLASS */
+
+	if (!obj->dgram)
+	{
+#ifdef ICMP6_FILTER
+		if (addrfam == AF_INET6)
+		{
+			struct icmp6_filter filter;
+
+			ICMP6_FILTER_SETBLOCKALL (&filter);
+			ICMP6_FILTER_SETPASS (ICMP6_ECHO_REPLY, &filter);
+			setsockopt (fd, IPPROTO_ICMPV6, ICMP6_FILTER,
+					&filter, sizeof (filter));
+		}
+#endif /* ICMP6_FILTER */
+		ping_filter_attach (obj, fd, addrfam);
+	}
+
+	if (ping_event_add (obj, fd) != 0)
+	{
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* ping_open_sockets opens the sockets needed for the object's hosts, if
+ * they are not open yet. "function" is used in the error message if there
+ * are no hosts. */
+static int ping_open_sockets (pingobj_t *obj, const char *function)
+{
+	pinghost_t *ptr;
+
+	_Bool need_ipv4_socket = 0;
+	_Bool need_ipv6_socket = 0;
+
+	for (ptr = obj->head; ptr != NULL; ptr = ptr->next)
+	{
+		if (ptr->addrfamily == AF_INET)
+			need_ipv4_socket = 1;
+		else if (ptr->addrfamily == AF_INET6)
+			need_ipv6_socket = 1;
+	}
+
+	if (!need_ipv4_socket && !need_ipv6_socket)
+	{
+		ping_set_error (obj, function, "No hosts to ping");
+		return (-1);
+	}
+
+	if (need_ipv4_socket && obj->fd4 == -1)
+	{
+		obj->fd4 = ping_open_socket(obj, AF_INET);
+		if (obj->fd4 == -1)
+			return (-1);
+		ping_set_ttl (obj, obj->ttl);
+		ping_set_qos (obj, obj->qos);
+	}
+	if (need_ipv6_socket && obj->fd6 == -1)
+	{
+		obj->fd6 = ping_open_socket(obj, AF_INET6);
+		if (obj->fd6 == -1)
+			return (-1);
+		ping_set_ttl (obj, obj->ttl);
+		ping_set_qos (obj, obj->qos);
+	}
+
+	ping_filter_update (obj);
+
+	return (0);
+} /* int ping_open_sockets */
+
+/* ping_reopen_sockets replaces the open sockets by raw sockets or, if
+ * "dgram" is set, ping sockets, for PING_OPT_DGRAM. Replies to requests
+ * still outstanding go to the old sockets and are lost. If a new socket
+ * cannot be opened, nothing is changed. */
+static int ping_reopen_sockets (pingobj_t *obj, int dgram)
+{
+	int old_dgram = obj->dgram;
+	struct pingtx old_tx4 = obj->tx4;
+	struct pingtx old_tx6 = obj->tx6;
+	int fd4 = -1;
+	int fd6 = -1;
+
+	obj->dgram = dgram;
+	if ((obj->fd4 == -1) && (obj->fd6 == -1))
+		return (0);
+
+	/* The new sockets start without transmit timestamps. */
+	obj->tx4.enabled = 0;
+	obj->tx6.enabled = 0;
+
+	if (obj->fd4 != -1)
+		fd4 = ping_open_socket (obj, AF_INET);
+	if ((obj->fd6 != -1) && ((obj->fd4 == -1) || (fd4 != -1)))
+		fd6 = ping_open_socket (obj, AF_INET6);
+
+	if (((obj->fd4 != -1) && (fd4 == -1))
+			|| ((obj->fd6 != -1) && (fd6 == -1)))
+	{
+		if (fd4 != -1)
+			close (fd4);
+		/* Only the ring may have been allocated since. */
+		obj->dgram = old_dgram;
+		obj->tx4.key = old_tx4.key;
+		obj->tx4.enabled = old_tx4.enabled;
+		obj->tx6.key = old_tx6.key;
+		obj->tx6.enabled = old_tx6.enabled;
+		return (-1);
+	}
+
+	/* Closing a socket also removes it from the epoll set. */
+	if (fd4 != -1)
+	{
+		close (obj->fd4);
+		obj->fd4 = fd4;
+		obj->fd4_ready = 0;
+	}
+	if (fd6 != -1)
+	{
+		close (obj->fd6);
+		obj->fd6 = fd6;
+		obj->fd6_ready = 0;
+	}
+
+	/* The new sockets got filters for the current slot table. */
+	obj->filter_size = obj->slots_size;
+	ping_set_ttl (obj, obj->ttl);
+	ping_set_qos (obj, obj->qos);
+
+	return (0);
+} /* int ping_reopen_sockets */
+
+/* ping_pace_tokens refills the token bucket of the current round up to "now"
+ * and returns the number of echo requests that may be sent right away. */
+static int ping_pace_tokens (pingobj_t *obj, struct timespec *now)
+{
+	struct timespec elapsed;
+	double burst;
+
+	if (obj->pace_rate <= 0.0)
+		return (INT_MAX);
+
+	if (ping_timespec_sub (now, &obj->pace_time, &elapsed) == 0)
+		obj->pace_tokens += obj->pace_rate
+			* ping_timespec_get (&elapsed);
+	obj->pace_time = *now;
+
+	burst = obj->pace_rate * PING_PACE_BURST;
+	if (burst < 1.0)
+		burst = 1.0;
+	if (obj->pace_tokens > burst)
+		obj->pace_tokens = burst;
+
+	return ((int) obj->pace_tokens);
+}
+
+/* ping_send_deadline returns the time at which the current round has to be
+ * looked at again: the end of the round, the earliest deadline of a host with
+ * adaptive timeouts or, when pacing, the time the next echo request may be
+ * sent, whichever comes first. */
+static void ping_send_deadline (pingobj_t *obj, struct timespec *deadline)
+{
+	*deadline = obj->round_end;
+
+	if ((obj->heap_len > 0) && (ping_timespec_cmp (&obj->heap[0]->due,
+					deadline) < 0))
+		*deadline = obj->heap[0]->due;
+
+	if ((obj->pace_rate > 0.0) && (obj->pace_tokens < 1.0)
+			&& ((obj->host_to_ping4 != NULL)
+				|| (obj->host_to_ping6 != NULL)))
+	{
+		struct timespec wait;
+		struct timespec next;
+
+		ping_timespec_set (&wait,
+				(1.0 - obj->pace_tokens) / obj->pace_rate);
+		ping_timespec_add (&obj->pace_time, &wait, &next);
+		if (ping_timespec_cmp (&next, deadline) < 0)
+			*deadline = next;
+	}
+}
+
+/* ping_send_step makes as much progress on the current round as possible
+ * without blocking: it reads all available replies and sends echo requests
+ * while the sockets are writable. Returns one if the round is complete, i.e.
+ * all replies have been received or the timeout has passed, zero if it has to
+ * wait for the sockets and -1 on error. */
+static int ping_send_step (pingobj_t *obj)
+{
+	struct timespec nowtime;
+	struct timespec timeout;
+
+	while ((obj->pings_in_flight > 0) || (obj->host_to_ping4 != NULL)
+			|| (obj->host_to_ping6 != NULL))
+	{
+		int send4, send6;
+
+		if (ping_clock_now (&nowtime) == -1)
+		{
+			ping_set_errno (obj, errno);
+			return (-1);
+		}
+
+		if (ping_timespec_sub (&obj->round_end, &nowtime, &timeout)
+				== -1)
+		{
+			dprintf ("Round timed out\n");
+			return (1);
+		}
+
+		/* first, check if we can receive replies ... */
+		if (obj->fd6_ready & PING_FD_READABLE)
+		{
+			int status = ping_receive_all (obj, &nowtime, AF_INET6);
+			if (status < 0)
+				return (-1);
+			if (status > 0)
+			{
+				obj->pings_in_flight -= status;
+				obj->pongs_received += status;
+			}
+			continue;
+		}
+		if (obj->fd4_ready & PING_FD_READABLE)
+		{
+			int status = ping_receive_all (obj, &nowtime, AF_INET);
+			if (status < 0)
+				return (-1);
+			if (status > 0)
+			{
+				obj->pings_in_flight -= status;
+				obj->pongs_received += status;
+			}
+			continue;
+		}
+
+		/* With adaptive timeouts, give up on each host at its own
+		 * deadline once all pending replies have been read. */
+		if ((obj->heap_len > 0) && (ping_timespec_cmp (&nowtime,
+						&obj->heap[0]->due) >= 0))
+		{
+			pinghost_t *ph = obj->heap[0];
+
+			dprintf ("No reply from %s\n", ping_host_hostname (ph));
+			ping_heap_remove (obj, ph);
+			ping_probe_clear (ph, ping_probe_oldest (ph));
+			obj->pings_in_flight--;
+			obj->pings_expired++;
+			continue;
+		}
+
+		/* ... and if no reply is available to read, continue sending
+		 * out pings. */
+		send4 = (obj->host_to_ping4 != NULL)
+			&& (obj->fd4_ready & PING_FD_WRITABLE);
+		send6 = (obj->host_to_ping6 != NULL)
+			&& (obj->fd6_ready & PING_FD_WRITABLE);
+		if (send4 || send6)
+		{
+			struct timespec nowait = { 0, 0 };
+			int limit;
+			int sent;
+
+			/* Wait for the token bucket to refill. */
+			limit = ping_pace_tokens (obj, &nowtime);
+			if (limit < 1)
+				return (0);
+
+			if (send4)
+				sent = ping_send_batch (obj,
+						&obj->host_to_ping4,
+						AF_INET, limit, &nowtime,
+						&obj->error_count);
+			else
+				sent = ping_send_batch (obj,
+						&obj->host_to_ping6,
+						AF_INET6, limit, &nowtime,
+						&obj->error_count);
+
+			if (sent > 0)
+			{
+				obj->pings_in_flight += sent;
+				obj->pace_tokens -= (double) sent;
+			}
+
+			/* When pacing, the last echo request may leave long
+			 * after the round started. Give it the full timeout,
+			 * too. */
+			if ((obj->pace_rate > 0.0)
+					&& (obj->host_to_ping4 == NULL)
+					&& (obj->host_to_ping6 == NULL))
+			{
+				ping_timespec_set (&timeout, obj->timeout);
+				ping_timespec_add (&nowtime, &timeout,
+						&obj->round_end);
+			}
+
+			/* Replies to this batch may be arriving already. Pick
+			 * them up before sending the next batch so the
+			 * receive buffers don't overflow. */
+			if (ping_event_wait (obj, &nowait, 0, 0) < 0)
+				return (-1);
+			continue;
+		}
+
+		return (0);
+	}
+
+	return (1);
+} /* int ping_send_step */
+
+/* ping_run_step handles all events of continuous mode that are due: it reads
+ * all available replies, gives up on echo requests that timed out and sends
+ * the echo requests that are due. Returns zero on success and -1 on error. */
+static int ping_run_step (pingobj_t *obj)
+{
+	struct timespec nowtime;
+	int status = 0;
+
+	if (ping_clock_now (&nowtime) == -1)
+	{
+		ping_set_errno (obj, errno);
+		return (-1);
+	}
+
+	ping_refresh (obj, &nowtime);
+
+	if (obj->fd6_ready & PING_FD_READABLE)
+		status = ping_receive_all (obj, &nowtime, AF_INET6);
+	if ((status >= 0) && (obj->fd4_ready & PING_FD_READABLE))
+		status = ping_receive_all (obj, &nowtime, AF_INET);
+	if (status < 0)
+	{
+		ping_host_reap (obj);
+		return (-1);
+	}
+
+	while ((obj->heap_len > 0) && (ping_timespec_cmp (&nowtime,
+					&obj->heap[0]->due) >= 0))
+	{
+		pinghost_t *ph = obj->heap[0];
+		struct timespec *sent = ping_probe_oldest (ph);
+		struct timespec interval;
+		int fd;
+
+		/* The oldest outstanding echo request timed out. */
+		if (sent != NULL)
+		{
+			struct timespec deadline;
+
+			ping_host_deadline (obj, ph, sent, &deadline);
+			if (ping_timespec_cmp (&nowtime, &deadline) >= 0)
+			{
+				dprintf ("No reply from %s\n",
+						ping_host_hostname (ph));
+				ping_probe_clear (ph, sent);
+				ph->latency = -1.0;
+				ph->latency_ns = -1;
+				ph->dropped++;
+				ping_host_done (obj, ph);
+				continue;
+			}
+		}
+
+		if (ping_timespec_cmp (&nowtime, &ph->next_send) < 0)
+		{
+			/* Not due yet; only the deadline was. */
+			ping_host_schedule (obj, ph);
+			continue;
+		}
+
+		ping_timespec_set (&interval, (ph->interval > 0.0)
+				? ph->interval : obj->interval);
+		ping_timespec_add (&ph->next_send, &interval, &ph->next_send);
+		/* Don't try to catch up if we fell behind. */
+		if (ping_timespec_cmp (&ph->next_send, &nowtime) < 0)
+			ping_timespec_add (&nowtime, &interval, &ph->next_send);
+
+		/* The window is full: the request sent "window" requests ago
+		 * is still unanswered. Grow the window or, if it is as large as
+		 * it gets, give up on that request to make room for the next
+		 * one. */
+		sent = ping_probe_timer (ph, ph->sequence);
+		if (ping_timespec_isset (sent) && (ping_probe_grow (ph) == 0))
+			sent = ping_probe_timer (ph, ph->sequence);
+		if (ping_timespec_isset (sent))
+		{
+			dprintf ("No reply from %s\n", ping_host_hostname (ph));
+			ping_probe_clear (ph, sent);
+			ph->latency = -1.0;
+			ph->latency_ns = -1;
+			ph->dropped++;
+			if (ping_host_notify (obj, ph) != 0)
+				continue;
 		}
-	} /* }}} if (1) */
-#endif /* SO_TIMESTAMP */
 
-	if (addrfam == AF_INET)
-	{
-#ifdef IP_RECVTOS
-		/* Enable receiving the TOS field */
-		setsockopt (fd, IPPROTO_IP, IP_RECVTOS, &(int){1}, sizeof(int));
-#endif /* IP_RECVTOS */
+		/* Hosts of another address family may have been added since
+		 * the sockets were opened. */
+		fd = (ph->addrfamily == AF_INET6) ? obj->fd6 : obj->fd4;
+		if ((fd == -1) && (ping_open_sockets (obj, "ping_run") != 0))
+		{
+			ping_host_schedule (obj, ph);
+			ping_host_reap (obj);
+			return (-1);
+		}
+		fd = (ph->addrfamily == AF_INET6) ? obj->fd6 : obj->fd4;
 
-		/* Enable receiving the TTL field */
-		setsockopt (fd, IPPROTO_IP, IP_RECVTTL, &(int){1}, sizeof(int));
-	}
-#if defined(IPV6_RECVHOPLIMIT) || defined(IPV6_RECVTCLASS)
-	else if (addrfam == AF_INET6)
-	{
-# if defined(IPV6_RECVHOPLIMIT)
-		/* For details see RFC 3542, section 6.3. */
-		setsockopt (fd, IPPROTO_IPV6, IPV6_RECVHOPLIMIT,
-		            &(int){1}, sizeof(int));
-# endif /* IPV6_RECVHOPLIMIT */
+		status = ping_send_one (obj, ph, fd, &nowtime);
+		if (status == EAGAIN)
+		{
+			/* The socket's send buffer is full. Try again shortly
+			 * with the same sequence number. */
+			ping_timespec_set (&interval, PING_SEND_RETRY);
+			ping_timespec_add (&nowtime, &interval,
+					&ph->next_send);
+			ping_host_schedule (obj, ph);
+			continue;
+		}
+		else if (status != 0)
+		{
+			/* Report the echo request as lost right away. */
+			ph->latency = -1.0;
+			ph->latency_ns = -1;
+			ph->dropped++;
+			ping_host_done (obj, ph);
+			continue;
+		}
 
-# if defined(IPV6_RECVTCLASS)
-		/* For details see RFC 3542, section 6.5. */
-		setsockopt (fd, IPPROTO_IPV6, IPV6_RECVTCLASS,
-		            &(int){1}, sizeof(int));
-# endif /* IPV6_RECVTCLASS */
+		ping_host_schedule (obj, ph);
 	}
-#endif /* IPV6_RECVHOPLIMIT || IPV6_RECVTCLASS */
 
-	return fd;
-}
+	ping_host_reap (obj);
+
+	return (0);
+} /* int ping_run_step */
 
 /*
  * public methods
@@ -1133,12 +4902,21 @@ pingobj_t *ping_construct (void)
 	memset (obj, 0, sizeof (*obj));
 
 	obj->timeout    = PING_DEF_TIMEOUT;
+	obj->timeout_min = PING_DEF_TIMEOUT_MIN;
 	obj->ttl        = PING_DEF_TTL;
 	obj->addrfamily = PING_DEF_AF;
-	obj->data       = strdup (PING_DEF_DATA);
+	obj->data       = ping_data_new (PING_DEF_DATA, strlen (PING_DEF_DATA));
+	obj->data_max   = strlen (PING_DEF_DATA);
 	obj->qos        = 0;
 	obj->fd4        = -1;
 	obj->fd6        = -1;
+	obj->batch_size = PING_DEF_BATCH_SIZE;
+	obj->interval   = PING_DEF_INTERVAL;
+	obj->ident_base = (uint16_t) (ping_get_ident () & 0xFFFF);
+	obj->cookie     = (uint32_t) ping_get_ident ();
+#if PING_USE_EPOLL
+	obj->efd        = -1;
+#endif
 
 	return (obj);
 }
@@ -1150,18 +4928,39 @@ void ping_destroy (pingobj_t *obj)
 	if (obj == NULL)
 		return;
 
-	current = obj->head;
+	if (obj->refresh != NULL)
+	{
+#if PING_USE_THREADS
+		pthread_join (obj->refresh_thread, /* retval = */ NULL);
+#endif
+		ping_refresh_free (obj->refresh);
+	}
+
+	for (current = obj->head; current != NULL; current = current->next)
+	{
+		ping_free_ext (current);
+		ping_data_unref (current->data);
+	}
+	ping_host_reap (obj);
 
-	while (current != NULL)
+	while (obj->host_blocks != NULL)
 	{
-		pinghost_t *next = current->next;
-		ping_free (current);
-		current = next;
+		struct pinghostblock *next = obj->host_blocks->next;
+		free (obj->host_blocks);
+		obj->host_blocks = next;
 	}
 
-	free (obj->data);
+	ping_data_unref (obj->data);
 	free (obj->srcaddr);
 	free (obj->device);
+	ping_batch_free (obj);
+	free (obj->heap);
+	free (obj->slots);
+	free (obj->slots_free);
+	free (obj->addrs);
+	free (obj->names);
+	free (obj->tx4.stamps);
+	free (obj->tx6.stamps);
 
 	if (obj->fd4 != -1)
 		close(obj->fd4);
@@ -1169,6 +4968,11 @@ void ping_destroy (pingobj_t *obj)
 	if (obj->fd6 != -1)
 		close(obj->fd6);
 
+#if PING_USE_EPOLL
+	if (obj->efd != -1)
+		close(obj->efd);
+#endif
+
 	free (obj);
 
 	return;
@@ -1230,13 +5034,23 @@ int ping_setopt (pingobj_t *obj, int option, void *value)
 			break;
 
 		case PING_OPT_DATA:
-			if (obj->data != NULL)
+			ret = ping_set_data (obj, value,
+					strlen ((const char *) value));
+			break;
+
+		case PING_OPT_DATA_BINARY:
+		{
+			ping_data_t *data = (ping_data_t *) value;
+
+			if ((data->data == NULL) && (data->size > 0))
 			{
-				free (obj->data);
-				obj->data = NULL;
+				ping_set_errno (obj, EINVAL);
+				ret = -1;
+				break;
 			}
-			obj->data = strdup ((const char *) value);
+			ret = ping_set_data (obj, data->data, data->size);
 			break;
+		} /* case PING_OPT_DATA_BINARY */
 
 		case PING_OPT_SOURCE:
 		{
@@ -1334,6 +5148,116 @@ int ping_setopt (pingobj_t *obj, int option, void *value)
 		} /* case PING_OPT_MARK */
 		break;
 
+		case PING_OPT_TIMEOUT_ADAPTIVE:
+			obj->timeout_adaptive = (*((int *) value) != 0);
+			break;
+
+		case PING_OPT_TIMEOUT_MIN:
+			obj->timeout_min = *((double *) value);
+			if (obj->timeout_min < 0.0)
+			{
+				obj->timeout_min = PING_DEF_TIMEOUT_MIN;
+				ret = -1;
+			}
+			break;
+
+		case PING_OPT_PAYLOAD_HEADER:
+		{
+			int payload_header = (*((int *) value) != 0);
+
+			/* The data set before must leave room for the
+			 * header. */
+			if (payload_header && !obj->payload_header
+					&& !ping_data_fits (obj,
+						ping_data_limit (1)))
+			{
+				ping_set_error (obj, "ping_setopt",
+						"Data too large");
+				ret = -1;
+				break;
+			}
+			obj->payload_header = payload_header;
+			break;
+		} /* case PING_OPT_PAYLOAD_HEADER */
+
+		case PING_OPT_TIMESTAMPING:
+			obj->timestamping = (*((int *) value) != 0);
+			/* Sockets already open change right away. */
+			if (obj->fd4 != -1)
+				ping_tx_setup (obj, obj->fd4, AF_INET);
+			if (obj->fd6 != -1)
+				ping_tx_setup (obj, obj->fd6, AF_INET6);
+			break;
+
+		case PING_OPT_DGRAM:
+		{
+			int dgram = (*((int *) value) != 0);
+
+			if (dgram != obj->dgram)
+				ret = ping_reopen_sockets (obj, dgram);
+			break;
+		} /* case PING_OPT_DGRAM */
+
+		case PING_OPT_SKIP_CHECKSUM:
+			obj->skip_checksum = (*((int *) value) != 0);
+			break;
+
+		case PING_OPT_RATE:
+			obj->send_rate = *((double *) value);
+			if (obj->send_rate < 0.0)
+			{
+				obj->send_rate = 0.0;
+				ret = -1;
+			}
+			break;
+
+		case PING_OPT_SPREAD:
+			obj->send_spread = *((double *) value);
+			if (obj->send_spread < 0.0)
+			{
+				obj->send_spread = 0.0;
+				ret = -1;
+			}
+			break;
+
+		case PING_OPT_RESOLVE_TTL:
+			obj->resolve_ttl = *((double *) value);
+			if (obj->resolve_ttl < 0.0)
+			{
+				obj->resolve_ttl = 0.0;
+				ret = -1;
+			}
+			break;
+
+		case PING_OPT_ALL_ADDRESSES:
+			obj->all_addresses = (*((int *) value) != 0);
+			break;
+
+		case PING_OPT_INTERVAL:
+			obj->interval = *((double *) value);
+			if (obj->interval <= 0.0)
+			{
+				obj->interval = PING_DEF_INTERVAL;
+				ret = -1;
+			}
+			break;
+
+		case PING_OPT_BATCH_SIZE:
+			ret = *((int *) value);
+			if ((ret < 1) || (ret > PING_MAX_BATCH_SIZE))
+			{
+				obj->batch_size = PING_DEF_BATCH_SIZE;
+				ret = -1;
+			}
+			else
+			{
+				obj->batch_size = ret;
+				ret = 0;
+			}
+			/* Reallocated with the new size on the next send. */
+			ping_batch_free (obj);
+			break;
+
 		default:
 			ret = -2;
 	} /* switch (option) */
@@ -1341,431 +5265,728 @@ int ping_setopt (pingobj_t *obj, int option, void *value)
 	return (ret);
 } /* int ping_setopt */
 
-int ping_send (pingobj_t *obj)
+int ping_send_start (pingobj_t *obj)
 {
 	pinghost_t *ptr;
+	int hosts_num = 0;
 
-	struct timeval endtime;
-	struct timeval nowtime;
-	struct timeval timeout;
+	struct timespec nowtime;
+	struct timespec timeout;
 
-	_Bool need_ipv4_socket = 0;
-	_Bool need_ipv6_socket = 0;
+	if (obj == NULL)
+		return (-1);
+
+	if (obj->run_active)
+	{
+		ping_set_error (obj, "ping_send", "Continuous mode is active");
+		return (-1);
+	}
+
+	obj->round_active = 0;
+
+	/* Without threads, this may block for a while, so the round's
+	 * times are taken afterwards. */
+	if (ping_clock_now (&nowtime) == 0)
+		ping_refresh (obj, &nowtime);
 
 	for (ptr = obj->head; ptr != NULL; ptr = ptr->next)
 	{
 		ptr->latency  = -1.0;
+		ptr->latency_ns = -1;
 		ptr->recv_ttl = -1;
+		/* Replies to earlier rounds don't count. */
+		ping_probe_clear_all (ptr);
+		hosts_num++;
+	}
 
-		if (ptr->addrfamily == AF_INET)
-			need_ipv4_socket = 1;
-		else if (ptr->addrfamily == AF_INET6)
-			need_ipv6_socket = 1;
+	if (ping_open_sockets (obj, "ping_send") != 0)
+		return (-1);
+
+	if (ping_clock_now (&nowtime) == -1)
+	{
+		ping_set_errno (obj, errno);
+		return (-1);
 	}
 
-	if (!need_ipv4_socket && !need_ipv6_socket)
+	/* Send at no more than send_rate echo requests per second and spread
+	 * the round over at least send_spread seconds. */
+	obj->pace_rate = obj->send_rate;
+	if ((obj->send_spread > 0.0) && (hosts_num > 0))
 	{
-		ping_set_error (obj, "ping_send", "No hosts to ping");
+		double rate = ((double) hosts_num) / obj->send_spread;
+
+		if ((obj->pace_rate <= 0.0) || (rate < obj->pace_rate))
+			obj->pace_rate = rate;
+	}
+	obj->pace_tokens = 1.0;
+	obj->pace_time   = nowtime;
+
+	/* Set up timeout. When pacing, sending takes a while, too; the round
+	 * end is moved once the last echo request has been sent. */
+	if (obj->pace_rate > 0.0)
+		ping_timespec_set (&timeout, obj->timeout
+				+ (((double) hosts_num) / obj->pace_rate));
+	else
+		ping_timespec_set (&timeout, obj->timeout);
+
+	dprintf ("Set timeout to %i.%09li seconds\n",
+			(int) timeout.tv_sec,
+			(long) timeout.tv_nsec);
+
+	ping_timespec_add (&nowtime, &timeout, &obj->round_end);
+
+	obj->host_to_ping4   = ping_next_host (obj->head, AF_INET);
+	obj->host_to_ping6   = ping_next_host (obj->head, AF_INET6);
+	obj->pings_in_flight = 0;
+	obj->pongs_received  = 0;
+	obj->error_count     = 0;
+	obj->pings_expired   = 0;
+	obj->round_active    = 1;
+	ping_heap_clear (obj);
+
+	/* Send out as many echo requests as the sockets take right away. */
+	return (ping_send_step (obj));
+} /* int ping_send_start */
+
+int ping_send_fds (pingobj_t *obj, int *fds, int *events, size_t fds_num)
+{
+	size_t num = 0;
+
+	if ((obj == NULL) || (fds == NULL) || (events == NULL))
 		return (-1);
+
+	if ((obj->fd4 != -1) && (num < fds_num))
+	{
+		fds[num] = obj->fd4;
+		events[num] = PING_EVENT_READ;
+		if ((obj->host_to_ping4 != NULL)
+				&& !(obj->fd4_ready & PING_FD_WRITABLE))
+			events[num] |= PING_EVENT_WRITE;
+		num++;
 	}
 
-	if (need_ipv4_socket && obj->fd4 == -1)
+	if ((obj->fd6 != -1) && (num < fds_num))
 	{
-		obj->fd4 = ping_open_socket(obj, AF_INET);
-		if (obj->fd4 == -1)
-			return (-1);
-		ping_set_ttl (obj, obj->ttl);
-		ping_set_qos (obj, obj->qos);
+		fds[num] = obj->fd6;
+		events[num] = PING_EVENT_READ;
+		if ((obj->host_to_ping6 != NULL)
+				&& !(obj->fd6_ready & PING_FD_WRITABLE))
+			events[num] |= PING_EVENT_WRITE;
+		num++;
 	}
-	if (need_ipv6_socket && obj->fd6 == -1)
+
+	return ((int) num);
+} /* int ping_send_fds */
+
+double ping_send_timeout (pingobj_t *obj)
+{
+	struct timespec nowtime;
+	struct timespec timeout;
+	struct timespec deadline;
+
+	if ((obj == NULL) || !obj->round_active)
+		return (-1.0);
+
+	if (ping_clock_now (&nowtime) == -1)
+		return (0.0);
+
+	ping_send_deadline (obj, &deadline);
+	if (ping_timespec_sub (&deadline, &nowtime, &timeout) == -1)
+		return (0.0);
+
+	return (ping_timespec_get (&timeout));
+} /* double ping_send_timeout */
+
+int ping_send_process (pingobj_t *obj, int fd, int events)
+{
+	if (obj == NULL)
+		return (-1);
+
+	if (!obj->round_active)
 	{
-		obj->fd6 = ping_open_socket(obj, AF_INET6);
-		if (obj->fd6 == -1)
-			return (-1);
-		ping_set_ttl (obj, obj->ttl);
-		ping_set_qos (obj, obj->qos);
+		ping_set_error (obj, "ping_send_process",
+				"No round in progress");
+		return (-1);
+	}
+
+	if (fd != -1)
+		ping_event_set (obj, fd, events & PING_EVENT_READ,
+				events & PING_EVENT_WRITE);
+
+	return (ping_send_step (obj));
+} /* int ping_send_process */
+
+int ping_send_finish (pingobj_t *obj)
+{
+	pinghost_t *ph;
+
+	if (obj == NULL)
+		return (-1);
+
+	if (!obj->round_active)
+	{
+		ping_set_error (obj, "ping_send_finish",
+				"No round in progress");
+		return (-1);
+	}
+
+	/* If the round ended before all replies have been received, the
+	 * remaining hosts are considered to have dropped the packet. */
+	if ((obj->pings_in_flight > 0) || (obj->pings_expired > 0)
+			|| (obj->host_to_ping4 != NULL)
+			|| (obj->host_to_ping6 != NULL))
+	{
+		for (ph = obj->head; ph != NULL; ph = ph->next)
+			if (ph->latency < 0.0)
+				ph->dropped++;
+	}
+
+	obj->round_active  = 0;
+	obj->host_to_ping4 = NULL;
+	obj->host_to_ping6 = NULL;
+	ping_heap_clear (obj);
+
+	if (obj->error_count)
+		return (-1 * obj->error_count);
+	return (obj->pongs_received);
+} /* int ping_send_finish */
+
+int ping_send (pingobj_t *obj)
+{
+	int status;
+
+	status = ping_send_start (obj);
+	if (status < 0)
+		return (-1);
+
+	while (status == 0)
+	{
+		struct timespec nowtime;
+		struct timespec timeout;
+		struct timespec deadline;
+		int want4, want6;
+
+		if (ping_clock_now (&nowtime) == -1)
+		{
+			ping_set_errno (obj, errno);
+			status = -1;
+			break;
+		}
+
+		ping_send_deadline (obj, &deadline);
+		if (ping_timespec_sub (&deadline, &nowtime, &timeout) == -1)
+			ping_timespec_clear (&timeout);
+
+		dprintf ("Waiting on %i sockets for %u.%09lu seconds\n",
+				((obj->fd4 != -1) ? 1 : 0) + ((obj->fd6 != -1) ? 1 : 0),
+				(unsigned) timeout.tv_sec,
+				(unsigned long) timeout.tv_nsec);
+
+		/* Wait for writability only where requests are left to send. */
+		want4 = (obj->host_to_ping4 != NULL)
+			&& !(obj->fd4_ready & PING_FD_WRITABLE);
+		want6 = (obj->host_to_ping6 != NULL)
+			&& !(obj->fd6_ready & PING_FD_WRITABLE);
+
+		if (ping_event_wait (obj, &timeout, want4, want6) < 0)
+		{
+			dprintf ("ping_event_wait: %s\n", obj->errmsg);
+			status = -1;
+			break;
+		}
+
+		status = ping_send_step (obj);
+	}
+
+	if (status < 0)
+	{
+		obj->round_active = 0;
+		return (-1);
+	}
+
+	return (ping_send_finish (obj));
+} /* int ping_send */
+
+int ping_set_callback (pingobj_t *obj, ping_callback_t callback, void *arg)
+{
+	if (obj == NULL)
+		return (-1);
+
+	obj->callback = callback;
+	obj->callback_arg = arg;
+
+	return (0);
+}
+
+int ping_run_start (pingobj_t *obj)
+{
+	struct timespec nowtime;
+	pinghost_t *ph;
+	size_t hosts_num = 0;
+	size_t i = 0;
+
+	if (obj == NULL)
+		return (-1);
+
+	if (obj->round_active)
+	{
+		ping_set_error (obj, "ping_run", "A round is in progress");
+		return (-1);
 	}
 
-	if (gettimeofday (&nowtime, NULL) == -1)
+	if (obj->run_active)
+		ping_run_stop (obj);
+
+	if (ping_open_sockets (obj, "ping_run") != 0)
+		return (-1);
+
+	if (ping_clock_now (&nowtime) == -1)
 	{
 		ping_set_errno (obj, errno);
 		return (-1);
 	}
 
-	/* Set up timeout */
-	timeout.tv_sec = (time_t) obj->timeout;
-	timeout.tv_usec = (suseconds_t) (1000000 * (obj->timeout - ((double) timeout.tv_sec)));
+	for (ph = obj->head; ph != NULL; ph = ph->next)
+		hosts_num++;
 
-	dprintf ("Set timeout to %i.%06i seconds\n",
-			(int) timeout.tv_sec,
-			(int) timeout.tv_usec);
+	/* Spread the first echo requests evenly across each host's
+	 * interval, so the send load is spread evenly, too. */
+	for (ph = obj->head; ph != NULL; ph = ph->next, i++)
+	{
+		double interval = (ph->interval > 0.0)
+			? ph->interval : obj->interval;
+		struct timespec phase;
+
+		ping_timespec_set (&phase, interval * ((double) i)
+				/ ((double) hosts_num));
+		ping_timespec_add (&nowtime, &phase, &ph->next_send);
+		ping_probe_clear_all (ph);
+		ph->latency = -1.0;
+		ph->latency_ns = -1;
+		ph->due = ph->next_send;
+
+		if (ping_heap_insert (obj, ph) != 0)
+		{
+			ping_run_stop (obj);
+			return (-1);
+		}
+	}
+
+	obj->run_active = 1;
+
+	return (ping_run_step (obj));
+} /* int ping_run_start */
+
+double ping_run_timeout (pingobj_t *obj)
+{
+	struct timespec nowtime;
+	struct timespec timeout;
 
-	ping_timeval_add (&nowtime, &timeout, &endtime);
+	if ((obj == NULL) || !obj->run_active || (obj->heap_len == 0))
+		return (-1.0);
 
-	/* host_to_ping points to the host to which to send the next ping. The
-	 * pointer is advanced to the next host in the linked list after the
-	 * ping has been sent. If host_to_ping is NULL, no more pings need to be
-	 * send out. */
-	pinghost_t *host_to_ping = obj->head;
+	if (ping_clock_now (&nowtime) == -1)
+		return (0.0);
 
-	/* pings_in_flight is the number of hosts we sent a "ping" to but didn't
-	 * receive a "pong" yet. */
-	int pings_in_flight = 0;
+	if (ping_timespec_sub (&obj->heap[0]->due, &nowtime, &timeout) == -1)
+		return (0.0);
 
-	/* pongs_received is the number of echo replies received. Unless there
-	 * is an error, this is used as the return value of ping_send(). */
-	int pongs_received = 0;
+	return (ping_timespec_get (&timeout));
+} /* double ping_run_timeout */
 
-	int error_count = 0;
+int ping_run_process (pingobj_t *obj, int fd, int events)
+{
+	if (obj == NULL)
+		return (-1);
 
-	while (pings_in_flight > 0 || host_to_ping != NULL)
+	if (!obj->run_active)
 	{
-		fd_set read_fds;
-		fd_set write_fds;
-
-		int write_fd = -1;
-		int max_fd = -1;
+		ping_set_error (obj, "ping_run_process",
+				"Continuous mode is not active");
+		return (-1);
+	}
 
-		FD_ZERO (&read_fds);
-		FD_ZERO (&write_fds);
+	if (fd != -1)
+		ping_event_set (obj, fd, events & PING_EVENT_READ,
+				events & PING_EVENT_WRITE);
 
-		if (obj->fd4 != -1)
-		{
-			FD_SET(obj->fd4, &read_fds);
-			if (host_to_ping != NULL && host_to_ping->addrfamily == AF_INET)
-				write_fd = obj->fd4;
+	return (ping_run_step (obj));
+} /* int ping_run_process */
 
-			if (max_fd < obj->fd4)
-				max_fd = obj->fd4;
-		}
+int ping_run_stop (pingobj_t *obj)
+{
+	if (obj == NULL)
+		return (-1);
 
-		if (obj->fd6 != -1)
-		{
-			FD_SET(obj->fd6, &read_fds);
-			if (host_to_ping != NULL && host_to_ping->addrfamily == AF_INET6)
-				write_fd = obj->fd6;
+	ping_heap_clear (obj);
 
-			if (max_fd < obj->fd6)
-				max_fd = obj->fd6;
-		}
+	obj->run_active = 0;
 
-		if (write_fd != -1)
-			FD_SET(write_fd, &write_fds);
+	return (0);
+} /* int ping_run_stop */
 
-		assert (max_fd != -1);
-		assert (max_fd < FD_SETSIZE);
+int ping_run (pingobj_t *obj, double duration)
+{
+	struct timespec endtime;
+	struct timespec nowtime;
+	int status;
 
-		if (gettimeofday (&nowtime, NULL) == -1)
-		{
-			ping_set_errno (obj, errno);
-			return (-1);
-		}
+	if (ping_run_start (obj) != 0)
+		return (-1);
 
-		if (ping_timeval_sub (&endtime, &nowtime, &timeout) == -1)
-			break;
+	if (ping_clock_now (&nowtime) == -1)
+	{
+		ping_set_errno (obj, errno);
+		ping_run_stop (obj);
+		return (-1);
+	}
 
-		dprintf ("Waiting on %i sockets for %u.%06u seconds\n",
-				((obj->fd4 != -1) ? 1 : 0) + ((obj->fd6 != -1) ? 1 : 0),
-				(unsigned) timeout.tv_sec,
-				(unsigned) timeout.tv_usec);
+	ping_timespec_set (&endtime, duration);
+	ping_timespec_add (&nowtime, &endtime, &endtime);
 
-		int status = select (max_fd + 1, &read_fds, &write_fds, NULL, &timeout);
-		int select_errno = errno;
+	status = 0;
+	while (status == 0)
+	{
+		struct timespec timeout = { 86400, 0 };
+		struct timespec left;
 
-		if (gettimeofday (&nowtime, NULL) == -1)
+		if (ping_clock_now (&nowtime) == -1)
 		{
 			ping_set_errno (obj, errno);
-			return (-1);
-		}
-
-		if (status == -1)
-		{
-			ping_set_errno (obj, select_errno);
-			dprintf ("select: %s\n", obj->errmsg);
-			return (-1);
-		}
-		else if (status == 0)
-		{
-			dprintf ("select timed out\n");
-
-			pinghost_t *ph;
-			for (ph = obj->head; ph != NULL; ph = ph->next)
-				if (ph->latency < 0.0)
-					ph->dropped++;
+			status = -1;
 			break;
 		}
 
-		/* first, check if we can receive a reply ... */
-		if (obj->fd6  != -1 && FD_ISSET (obj->fd6, &read_fds))
-		{
-			if (ping_receive_one (obj, &nowtime, AF_INET6) == 0)
-			{
-				pings_in_flight--;
-				pongs_received++;
-			}
-			continue;
-		}
-		if (obj->fd4 != -1 && FD_ISSET (obj->fd4, &read_fds))
-		{
-			if (ping_receive_one (obj, &nowtime, AF_INET) == 0)
-			{
-				pings_in_flight--;
-				pongs_received++;
-			}
-			continue;
-		}
-
-		/* ... and if no reply is available to read, continue sending
-		 * out pings. */
+		/* Wait until the next host is due ... */
+		if ((obj->heap_len > 0)
+				&& (ping_timespec_sub (&obj->heap[0]->due,
+						&nowtime, &timeout) == -1))
+			ping_timespec_clear (&timeout);
 
-		/* this condition should always be true. We keep it for
-		 * consistency with the read blocks above and just to be on the
-		 * safe side. */
-		if (write_fd != -1 && FD_ISSET (write_fd, &write_fds))
+		/* ... or until the end, if that comes first. */
+		if (duration > 0.0)
 		{
-			if (ping_send_one (obj, host_to_ping, write_fd) == 0)
-				pings_in_flight++;
-			else
-				error_count++;
-			host_to_ping = host_to_ping->next;
-			continue;
+			if (ping_timespec_sub (&endtime, &nowtime, &left) == -1)
+				break;
+			if (ping_timespec_cmp (&left, &timeout) < 0)
+				timeout = left;
 		}
-	} /* while (1) */
-
-	if (error_count)
-		return (-1 * error_count);
-	return (pongs_received);
-} /* int ping_send */
 
-static pinghost_t *ping_host_search (pinghost_t *ph, const char *host)
-{
-	while (ph != NULL)
-	{
-		if (strcasecmp (ph->username, host) == 0)
+		if (ping_event_wait (obj, &timeout, 0, 0) < 0)
+		{
+			status = -1;
 			break;
+		}
 
-		ph = ph->next;
+		status = ping_run_step (obj);
 	}
 
-	return (ph);
-}
+	ping_run_stop (obj);
+
+	return (status);
+} /* int ping_run */
 
 int ping_host_add (pingobj_t *obj, const char *host)
 {
-	pinghost_t *ph;
-
-	struct addrinfo  ai_hints;
-	struct addrinfo *ai_list, *ai_ptr;
-	int              ai_return;
+	struct pinghostquery query;
+	int status;
 
 	if ((obj == NULL) || (host == NULL))
 		return (-1);
 
-	dprintf ("host = %s\n", host);
-
-	if (ping_host_search (obj->head, host) != NULL)
+	if (ping_name_lookup (obj, host) != NULL)
 		return (0);
 
-	memset (&ai_hints, '\0', sizeof (ai_hints));
-	ai_hints.ai_flags     = 0;
-#ifdef AI_ADDRCONFIG
-	ai_hints.ai_flags    |= AI_ADDRCONFIG;
-#endif
-#ifdef AI_CANONNAME
-	ai_hints.ai_flags    |= AI_CANONNAME;
-#endif
-	ai_hints.ai_family    = obj->addrfamily;
-	ai_hints.ai_socktype  = SOCK_RAW;
+	memset (&query, 0, sizeof (query));
+	query.host = host;
+	query.addrfamily = obj->addrfamily;
+	ping_host_resolve (&query);
+
+	status = ping_host_add_resolved (obj, &query);
+	if (query.ai_list != NULL)
+		freeaddrinfo (query.ai_list);
 
-	if ((ph = ping_alloc ()) == NULL)
+	return (status);
+} /* int ping_host_add */
+
+int ping_host_add_addr (pingobj_t *obj, const char *name,
+		const struct sockaddr *addr, socklen_t addrlen)
+{
+	char buffer[INET6_ADDRSTRLEN];
+	socklen_t len;
+
+	if ((obj == NULL) || (addr == NULL))
+		return (-1);
+
+	if (addr->sa_family == AF_INET)
+		len = sizeof (struct sockaddr_in);
+	else if (addr->sa_family == AF_INET6)
+		len = sizeof (struct sockaddr_in6);
+	else
+		len = 0;
+
+	if ((len == 0) || (addrlen < len))
 	{
-		dprintf ("Out of memory!\n");
+		ping_set_error (obj, "ping_host_add_addr",
+				"Not an IPv4 or IPv6 address");
 		return (-1);
 	}
 
-	if ((ph->username = strdup (host)) == NULL)
+	if ((obj->addrfamily != AF_UNSPEC)
+			&& (obj->addrfamily != addr->sa_family))
 	{
-		dprintf ("Out of memory!\n");
-		ping_set_errno (obj, errno);
-		ping_free (ph);
+		ping_set_error (obj, "ping_host_add_addr",
+				"Address family does not match PING_OPT_AF");
 		return (-1);
 	}
 
-	if ((ph->hostname = strdup (host)) == NULL)
+	if (name != NULL)
 	{
-		dprintf ("Out of memory!\n");
-		ping_set_errno (obj, errno);
-		ping_free (ph);
+		if (ping_name_lookup (obj, name) != NULL)
+			return (0);
+	}
+	/* Without a name, the host is named by its address, which is only
+	 * formatted to look for it among the hosts added before, like
+	 * "ping_host_add_range" does. */
+	else if (obj->hosts_num > 0)
+	{
+		const void *src;
+
+		if (addr->sa_family == AF_INET)
+			src = &((const struct sockaddr_in *) addr)->sin_addr;
+		else
+			src = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+
+		if ((inet_ntop (addr->sa_family, src, buffer, sizeof (buffer))
+					!= NULL)
+				&& (ping_name_lookup (obj, buffer) != NULL))
+			return (0);
+	}
+
+	return (ping_host_add_sockaddr (obj, name, addr, len));
+} /* int ping_host_add_addr */
+
+int ping_host_add_range (pingobj_t *obj, const char *range)
+{
+	struct pingrange r;
+	size_t num;
+	size_t i;
+
+	if ((obj == NULL) || (range == NULL))
+		return (-1);
+
+	if (ping_range_parse (range, &r) != 0)
+	{
+		ping_set_error (obj, "ping_host_add_range", "Invalid range");
 		return (-1);
 	}
 
-	/* obj->data is not garuanteed to be != NULL */
-	if ((ph->data = strdup (obj->data == NULL ? PING_DEF_DATA : obj->data)) == NULL)
+	if ((obj->addrfamily != AF_UNSPEC) && (obj->addrfamily != r.addrfamily))
 	{
-		dprintf ("Out of memory!\n");
-		ping_set_errno (obj, errno);
-		ping_free (ph);
+		ping_set_error (obj, "ping_host_add_range",
+				"Address family does not match PING_OPT_AF");
 		return (-1);
 	}
 
-	if ((ai_return = getaddrinfo (host, NULL, &ai_hints, &ai_list)) != 0)
+	num = ping_range_size (&r);
+	if ((num == SIZE_MAX) || (obj->hosts_num + num > PING_MAX_SLOTS))
 	{
-#if defined(EAI_SYSTEM)
-		char errbuf[PING_ERRMSG_LEN];
-#endif
-		dprintf ("getaddrinfo failed\n");
-		ping_set_error (obj, "getaddrinfo",
-#if defined(EAI_SYSTEM)
-						(ai_return == EAI_SYSTEM)
-						? sstrerror (errno, errbuf, sizeof (errbuf)) :
-#endif
-				gai_strerror (ai_return));
-		ping_free (ph);
+		ping_set_error (obj, "ping_host_add_range", "Too many hosts");
 		return (-1);
 	}
 
-	if (ai_list == NULL)
-		ping_set_error (obj, "getaddrinfo", "No hosts returned");
+	if (ping_reserve (obj, obj->hosts_num + num) != 0)
+		return (-1);
 
-	for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next)
+	for (i = 0; i < num; i++, ping_range_next (r.first))
 	{
-		if (ai_ptr->ai_family == AF_INET)
+		pinghost_t *ph;
+
+		/* Skip addresses added before, like "ping_host_add" does. */
+		if (obj->hosts_num > 0)
 		{
-			ai_ptr->ai_socktype = SOCK_RAW;
-			ai_ptr->ai_protocol = IPPROTO_ICMP;
+			char name[INET6_ADDRSTRLEN];
+			const uint8_t *src = (r.addrfamily == AF_INET)
+				? r.first + 12 : r.first;
+			pinghost_t *dup = NULL;
+
+			if (inet_ntop (r.addrfamily, src, name, sizeof (name))
+					!= NULL)
+				dup = ping_name_lookup (obj, name);
+			if (dup != NULL)
+				continue;
 		}
-		else if (ai_ptr->ai_family == AF_INET6)
+
+		if ((ph = ping_host_new (obj, /* host = */ NULL)) == NULL)
+			return (-1);
+
+		if (r.addrfamily == AF_INET6)
 		{
-			ai_ptr->ai_socktype = SOCK_RAW;
-			ai_ptr->ai_protocol = IPPROTO_ICMPV6;
+			struct sockaddr_in6 *sin6 = &ph->addr.sin6;
+
+			sin6->sin6_family = AF_INET6;
+			memcpy (&sin6->sin6_addr, r.first, 16);
+			ph->addrlen = sizeof (*sin6);
 		}
 		else
 		{
-			char errmsg[PING_ERRMSG_LEN];
-
-			snprintf (errmsg, PING_ERRMSG_LEN, "Unknown `ai_family': %i", ai_ptr->ai_family);
-			errmsg[PING_ERRMSG_LEN - 1] = '\0';
+			struct sockaddr_in *sin = &ph->addr.sin;
 
-			dprintf ("%s", errmsg);
-			ping_set_error (obj, "getaddrinfo", errmsg);
-			continue;
+			sin->sin_family = AF_INET;
+			memcpy (&sin->sin_addr, r.first + 12, 4);
+			ph->addrlen = sizeof (*sin);
 		}
+		ph->addrfamily = r.addrfamily;
 
-		assert (sizeof (struct sockaddr_storage) >= ai_ptr->ai_addrlen);
-		memset (ph->addr, '\0', sizeof (struct sockaddr_storage));
-		memcpy (ph->addr, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
-		ph->addrlen = ai_ptr->ai_addrlen;
-		ph->addrfamily = ai_ptr->ai_family;
+		if (ping_host_insert (obj, ph) != 0)
+			return (-1);
+	}
 
-#ifdef AI_CANONNAME
-		if ((ai_ptr->ai_canonname != NULL)
-				&& (strcmp (ph->hostname, ai_ptr->ai_canonname) != 0))
-		{
-			char *old_hostname;
+	return (0);
+} /* int ping_host_add_range */
 
-			dprintf ("ph->hostname = %s; ai_ptr->ai_canonname = %s;\n",
-					ph->hostname, ai_ptr->ai_canonname);
+int ping_host_add_many (pingobj_t *obj, const char * const *hosts,
+		size_t hosts_num, ping_add_callback_t callback, void *arg)
+{
+	struct pingresolver resolver;
+#if PING_USE_THREADS
+	pthread_t threads[PING_RESOLVE_THREADS];
+	size_t threads_num = 0;
+#endif
+	size_t i;
+	int failed = 0;
 
-			old_hostname = ph->hostname;
-			if ((ph->hostname = strdup (ai_ptr->ai_canonname)) == NULL)
-			{
-				/* strdup failed, falling back to old hostname */
-				ph->hostname = old_hostname;
-			}
-			else if (old_hostname != NULL)
-			{
-				free (old_hostname);
-			}
-		}
-#endif /* AI_CANONNAME */
-	} /* for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next) */
+	if ((obj == NULL) || ((hosts == NULL) && (hosts_num > 0)))
+		return (-1);
 
-	freeaddrinfo (ai_list);
+	if (hosts_num == 0)
+		return (0);
 
-	/*
-	 * Adding in the front is much easier, but then the iterator will
-	 * return the host that was added last as first host. That's just not
-	 * nice. -octo
-	 */
-	if (obj->head == NULL)
+	memset (&resolver, 0, sizeof (resolver));
+	resolver.queries = calloc (hosts_num, sizeof (*resolver.queries));
+	if (resolver.queries == NULL)
 	{
-		obj->head = ph;
+		ping_set_errno (obj, errno);
+		return (-1);
 	}
-	else
+	resolver.queries_num = hosts_num;
+
+	for (i = 0; i < hosts_num; i++)
 	{
-		pinghost_t *hptr;
+		struct pinghostquery *query = resolver.queries + i;
+
+		query->host = hosts[i];
+		query->addrfamily = obj->addrfamily;
+		query->skip = (hosts[i] == NULL)
+			|| (ping_name_lookup (obj, hosts[i]) != NULL);
+	}
 
-		hptr = obj->head;
-		while (hptr->next != NULL)
-			hptr = hptr->next;
+#if PING_USE_THREADS
+	pthread_mutex_init (&resolver.lock, /* attr = */ NULL);
 
-		assert ((hptr != NULL) && (hptr->next == NULL));
-		hptr->next = ph;
+	/* This thread resolves, too, so one thread less is started. If no
+	 * thread can be started, it resolves all names by itself. */
+	while ((threads_num + 1 < PING_RESOLVE_THREADS)
+			&& (threads_num + 1 < hosts_num))
+	{
+		if (pthread_create (threads + threads_num, /* attr = */ NULL,
+					ping_resolver_run, &resolver) != 0)
+			break;
+		threads_num++;
 	}
+#endif
 
-	ph->table_next = obj->table[ph->ident % PING_TABLE_LEN];
-	obj->table[ph->ident % PING_TABLE_LEN] = ph;
+	ping_resolver_run (&resolver);
 
-	return (0);
-} /* int ping_host_add */
+#if PING_USE_THREADS
+	for (i = 0; i < threads_num; i++)
+		pthread_join (threads[i], /* retval = */ NULL);
+	pthread_mutex_destroy (&resolver.lock);
+#endif
+
+	for (i = 0; i < hosts_num; i++)
+	{
+		struct pinghostquery *query = resolver.queries + i;
+		int status = 0;
+
+		if (query->host == NULL)
+		{
+			ping_set_errno (obj, EINVAL);
+			status = -1;
+		}
+		else if (!query->skip)
+		{
+			status = ping_host_add_resolved (obj, query);
+		}
+
+		if (query->ai_list != NULL)
+			freeaddrinfo (query->ai_list);
+
+		if (status != 0)
+			failed++;
+		if (callback != NULL)
+			(*callback) (obj, query->host, status, arg);
+	}
+
+	free (resolver.queries);
+
+	return (failed);
+} /* int ping_host_add_many */
 
 int ping_host_remove (pingobj_t *obj, const char *host)
 {
-	pinghost_t *pre, *cur, *target;
+	pinghost_t *cur;
 
 	if ((obj == NULL) || (host == NULL))
 		return (-1);
 
-	pre = NULL;
-	cur = obj->head;
-
-	while (cur != NULL)
-	{
-		if (strcasecmp (host, cur->username) == 0)
-			break;
-
-		pre = cur;
-		cur = cur->next;
-	}
-
+	cur = ping_name_lookup (obj, host);
 	if (cur == NULL)
 	{
 		ping_set_error (obj, "ping_host_remove", "Host not found");
 		return (-1);
 	}
 
-	if (pre == NULL)
-		obj->head = cur->next;
-	else
-		pre->next = cur->next;
-
-	target = cur;
-	pre = NULL;
-
-	cur = obj->table[target->ident % PING_TABLE_LEN];
-
+	/* With PING_OPT_ALL_ADDRESSES, a name may stand for several hosts. */
 	while (cur != NULL)
 	{
-		if (cur == target)
-			break;
+		pinghost_t *next = ping_name_next (cur);
 
-		pre = cur;
-		cur = cur->table_next;
+		ping_host_drop (obj, cur);
+		cur = next;
 	}
 
-	if (cur == NULL)
+	return (0);
+}
+
+int ping_set_host_callback (pingobj_t *obj, ping_host_callback_t callback,
+		void *arg)
+{
+	if (obj == NULL)
+		return (-1);
+
+	obj->host_callback = callback;
+	obj->host_callback_arg = arg;
+
+	return (0);
+}
+
+int ping_reserve (pingobj_t *obj, size_t num)
+{
+	if (obj == NULL)
+		return (-1);
+
+	if (num > PING_MAX_SLOTS)
 	{
-		ping_set_error(obj, "ping_host_remove", "Host not found (T)");
-		ping_free(target);
+		ping_set_error (obj, "ping_reserve", "Too many hosts");
 		return (-1);
 	}
 
-	if (pre == NULL)
-		obj->table[target->ident % PING_TABLE_LEN] = cur->table_next;
-	else
-		pre->table_next = cur->table_next;
-
-	ping_free (cur);
+	if ((ping_host_block_reserve (obj, num) != 0)
+			|| (ping_slot_reserve (obj, num) != 0)
+			|| (ping_addr_resize (obj, num) != 0)
+			|| (ping_name_resize (obj, num) != 0))
+		return (-1);
 
 	return (0);
 }
@@ -1789,13 +6010,7 @@ int ping_iterator_count (pingobj_t *obj)
 	if (obj == NULL)
 		return 0;
 
-	int count = 0;
-	pingobj_iter_t *iter = obj->head;
-	while (iter) {
-		count++;
-		iter = iter->next;
-	}
-	return count;
+	return ((int) obj->hosts_num);
 }
 
 int ping_iterator_get_info (pingobj_iter_t *iter, int info,
@@ -1814,31 +6029,46 @@ int ping_iterator_get_info (pingobj_iter_t *iter, int info,
 	switch (info)
 	{
 		case PING_INFO_USERNAME:
+		{
+			char name[INET6_ADDRSTRLEN];
+			const char *username = ping_host_name (iter, name,
+					sizeof (name));
+
 			ret = ENOMEM;
-			*buffer_len = strlen (iter->username) + 1;
+			*buffer_len = strlen (username) + 1;
 			if (orig_buffer_len <= *buffer_len)
 				break;
 			/* Since (orig_buffer_len > *buffer_len) `strncpy'
 			 * will copy `*buffer_len' and pad the rest of
 			 * `buffer' with null-bytes */
-			strncpy (buffer, iter->username, orig_buffer_len);
+			strncpy (buffer, username, orig_buffer_len);
 			ret = 0;
 			break;
+		} /* case PING_INFO_USERNAME */
 
 		case PING_INFO_HOSTNAME:
+		{
+			char name[INET6_ADDRSTRLEN];
+			const char *hostname = ping_host_hostname (iter);
+
+			if (hostname == NULL)
+				hostname = ping_host_name (iter, name,
+						sizeof (name));
+
 			ret = ENOMEM;
-			*buffer_len = strlen (iter->hostname) + 1;
+			*buffer_len = strlen (hostname) + 1;
 			if (orig_buffer_len < *buffer_len)
 				break;
 			/* Since (orig_buffer_len > *buffer_len) `strncpy'
 			 * will copy `*buffer_len' and pad the rest of
 			 * `buffer' with null-bytes */
-			strncpy (buffer, iter->hostname, orig_buffer_len);
+			strncpy (buffer, hostname, orig_buffer_len);
 			ret = 0;
 			break;
+		} /* case PING_INFO_HOSTNAME */
 
 		case PING_INFO_ADDRESS:
-			ret = getnameinfo ((struct sockaddr *) iter->addr,
+			ret = getnameinfo (&iter->addr.sa,
 					iter->addrlen,
 					(char *) buffer,
 					*buffer_len,
@@ -1879,6 +6109,15 @@ int ping_iterator_get_info (pingobj_iter_t *iter, int info,
 			ret = 0;
 			break;
 
+		case PING_INFO_LATENCY_NS:
+			ret = ENOMEM;
+			*buffer_len = sizeof (int64_t);
+			if (orig_buffer_len < sizeof (int64_t))
+				break;
+			*((int64_t *) buffer) = iter->latency_ns;
+			ret = 0;
+			break;
+
 		case PING_INFO_DROPPED:
 			ret = ENOMEM;
 			*buffer_len = sizeof (uint32_t);
@@ -1908,10 +6147,14 @@ int ping_iterator_get_info (pingobj_iter_t *iter, int info,
 
 		case PING_INFO_DATA:
 			ret = ENOMEM;
-			*buffer_len = strlen (iter->data);
+			*buffer_len = iter->data->size;
 			if (orig_buffer_len < *buffer_len)
 				break;
-			strncpy ((char *) buffer, iter->data, orig_buffer_len);
+			memcpy (buffer, iter->data->data, iter->data->size);
+			/* Terminate data set with PING_OPT_DATA, if there's
+			 * room. */
+			if (orig_buffer_len > iter->data->size)
+				((char *) buffer)[iter->data->size] = 0;
 			ret = 0;
 			break;
 
@@ -1924,6 +6167,28 @@ int ping_iterator_get_info (pingobj_iter_t *iter, int info,
 			ret = 0;
 			break;
 
+		case PING_INFO_RTT_HISTORY:
+		{
+			const struct pinghostext *ext = iter->ext;
+			uint32_t num = (ext != NULL) ? ext->rtt_history_num : 0;
+			size_t i;
+
+			if (num > PING_RTT_HISTORY_LEN)
+				num = PING_RTT_HISTORY_LEN;
+
+			ret = ENOMEM;
+			*buffer_len = num * sizeof (double);
+			if (orig_buffer_len < *buffer_len)
+				break;
+			/* Oldest first. */
+			for (i = 0; i < num; i++)
+				((double *) buffer)[i] = ext->rtt_history[
+					(ext->rtt_history_num - num + i)
+					% PING_RTT_HISTORY_LEN];
+			ret = 0;
+		}
+		break;
+
 		case PING_INFO_RECV_QOS:
 			ret = ENOMEM;
 			if (*buffer_len>sizeof(unsigned)) *buffer_len=sizeof(unsigned);
@@ -1938,6 +6203,17 @@ int ping_iterator_get_info (pingobj_iter_t *iter, int info,
 	return (ret);
 } /* ping_iterator_get_info */
 
+int ping_iterator_set_interval (pingobj_iter_t *iter, double interval)
+{
+	if (iter == NULL)
+		return (-1);
+
+	/* Zero or less means the object's interval is used. */
+	iter->interval = (interval > 0.0) ? interval : 0.0;
+
+	return (0);
+}
+
 void *ping_iterator_get_context (pingobj_iter_t *iter)
 {
 	if (iter == NULL)
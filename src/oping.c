@@ -203,6 +203,7 @@ typedef struct ping_context
 static double  opt_interval   = 1.0;
 static double  opt_timeout    = PING_DEF_TIMEOUT;
 static int     opt_addrfamily = PING_DEF_AF;
+static int     opt_all_addrs  = 0;
 static char   *opt_srcaddr    = NULL;
 static char   *opt_device     = NULL;
 static char   *opt_mark       = NULL;
@@ -461,6 +462,7 @@ static void usage_exit (const char *name, int status) /* {{{ */
 
 			"\nAvailable options:\n"
 			"  -4|-6        force the use of IPv4 or IPv6\n"
+			"  -A           ping all addresses of each host\n"
 			"  -c count     number of ICMP packets to send\n"
 			"  -i interval  interval with which to send ICMP packets\n"
 			"  -w timeout   time to wait for replies, in seconds\n"
@@ -682,7 +684,7 @@ static int read_options (int argc, char **argv) /* {{{ */
 
 	while (1)
 	{
-		optchar = getopt (argc, argv, "46c:hi:I:t:Q:f:D:Z:O:P:m:w:b"
+		optchar = getopt (argc, argv, "46Ac:hi:I:t:Q:f:D:Z:O:P:m:w:b"
 #if USE_NCURSES
 				"uUg:H:"
 #endif
@@ -698,6 +700,10 @@ static int read_options (int argc, char **argv) /* {{{ */
 				opt_addrfamily = (optchar == '4') ? AF_INET : AF_INET6;
 				break;
 
+			case 'A':
+				opt_all_addrs = 1;
+				break;
+
 			case 'c':
 				{
 					int new_count;
@@ -1297,8 +1303,12 @@ static int update_stats_from_context (ping_context_t *ctx, pingobj_iter_t *iter)
         } else if (opt_box_height > 1 ) {
             box (ctx->window, 0, 0);
             wattron (ctx->window, A_BOLD);
-            mvwprintw (ctx->window, /* y = */ 0, /* x = */ 5,
-                            " %s ", ctx->host);
+            if (opt_all_addrs)
+                mvwprintw (ctx->window, /* y = */ 0, /* x = */ 5,
+                                " %s (%s) ", ctx->host, ctx->addr);
+            else
+                mvwprintw (ctx->window, /* y = */ 0, /* x = */ 5,
+                                " %s ", ctx->host);
             wattroff (ctx->window, A_BOLD);
             wprintw (ctx->window, "ping statistics ");
         }
@@ -1740,9 +1750,14 @@ static int post_loop_hook (pingobj_t *ping) /* {{{ */
 
 		context = ping_iterator_get_context (iter);
 
-		printf ("\n--- %s ping statistics ---\n"
-				"%i packets transmitted, %i received, %.2f%% packet loss, time %.1fms\n",
-				context->host, context->req_sent, context->req_rcvd,
+		/* With -A, a host name may be listed once per address. */
+		if (opt_all_addrs)
+			printf ("\n--- %s (%s) ping statistics ---\n",
+					context->host, context->addr);
+		else
+			printf ("\n--- %s ping statistics ---\n", context->host);
+		printf ("%i packets transmitted, %i received, %.2f%% packet loss, time %.1fms\n",
+				context->req_sent, context->req_rcvd,
 				context_get_packet_loss (context),
 				context->latency_total);
 
@@ -1776,6 +1791,84 @@ static int post_loop_hook (pingobj_t *ping) /* {{{ */
 	return (failure_count);
 } /* }}} int post_loop_hook */
 
+static void add_host_callback (pingobj_t *ping, const char *host, /* {{{ */
+		int status, __attribute__((unused)) void *arg)
+{
+	if (status < 0)
+	{
+		const char *errmsg = ping_get_error (ping);
+
+		fprintf (stderr, "Adding host `%s' failed: %s\n", host, errmsg);
+	}
+} /* }}} void add_host_callback */
+
+/* Reads the hosts from "infile", one per line, and adds them all at once, so
+ * their names are resolved in parallel. */
+static int add_hosts_from_file (pingobj_t *ping, FILE *infile) /* {{{ */
+{
+	char line[256];
+	char host[256];
+	char **hosts = NULL;
+	size_t hosts_num = 0;
+	size_t hosts_size = 0;
+	size_t i;
+	int status = 0;
+
+	while (fgets(line, sizeof(line), infile))
+	{
+		/* Strip whitespace */
+		if (sscanf(line, "%s", host) != 1)
+			continue;
+
+		if ((host[0] == 0) || (host[0] == '#'))
+			continue;
+
+		if (hosts_num >= hosts_size)
+		{
+			size_t size = (hosts_size == 0) ? 64 : (2 * hosts_size);
+			char **tmp;
+
+			tmp = realloc (hosts, size * sizeof (*hosts));
+			if (tmp == NULL)
+			{
+				status = -1;
+				break;
+			}
+			hosts = tmp;
+			hosts_size = size;
+		}
+
+		if ((hosts[hosts_num] = strdup (host)) == NULL)
+		{
+			status = -1;
+			break;
+		}
+		hosts_num++;
+	}
+
+	if (status == 0)
+	{
+		ping_reserve (ping, (size_t) ping_iterator_count (ping) + hosts_num);
+		if (ping_host_add_many (ping, (const char * const *) hosts,
+					hosts_num, add_host_callback, NULL) < 0)
+		{
+			fprintf (stderr, "Adding hosts failed: %s\n",
+					ping_get_error (ping));
+			status = -1;
+		}
+	}
+	else
+	{
+		fprintf (stderr, "Reading hosts failed: %s\n", strerror (errno));
+	}
+
+	for (i = 0; i < hosts_num; i++)
+		free (hosts[i]);
+	free (hosts);
+
+	return (status);
+} /* }}} int add_hosts_from_file */
+
 int main (int argc, char **argv) /* {{{ */
 {
 	pingobj_t      *ping;
@@ -1867,6 +1960,9 @@ int main (int argc, char **argv) /* {{{ */
 	if (opt_addrfamily != PING_DEF_AF)
 		ping_setopt (ping, PING_OPT_AF, (void *) &opt_addrfamily);
 
+	if (opt_all_addrs)
+		ping_setopt (ping, PING_OPT_ALL_ADDRESSES, (void *) &opt_all_addrs);
+
 	if (opt_srcaddr != NULL)
 	{
 		if (ping_setopt (ping, PING_OPT_SOURCE, (void *) opt_srcaddr) != 0)
@@ -1906,8 +2002,6 @@ int main (int argc, char **argv) /* {{{ */
 	if (opt_filename != NULL)
 	{
 		FILE *infile;
-		char line[256];
-		char host[256];
 
 		if (strcmp (opt_filename, "-") == 0)
 			/* Open STDIN */
@@ -1935,27 +2029,7 @@ int main (int argc, char **argv) /* {{{ */
 		}
 #endif
 
-		while (fgets(line, sizeof(line), infile))
-		{
-			/* Strip whitespace */
-			if (sscanf(line, "%s", host) != 1)
-				continue;
-
-			if ((host[0] == 0) || (host[0] == '#'))
-				continue;
-
-			if (ping_host_add(ping, host) < 0)
-			{
-				const char *errmsg = ping_get_error (ping);
-
-				fprintf (stderr, "Adding host `%s' failed: %s\n", host, errmsg);
-				continue;
-			}
-			else
-			{
-				host_num++;
-			}
-		}
+		add_hosts_from_file (ping, infile);
 
 #if _POSIX_SAVED_IDS
 		/* Drop privileges */
@@ -1991,12 +2065,11 @@ int main (int argc, char **argv) /* {{{ */
 			fprintf (stderr, "Adding host `%s' failed: %s\n", argv[i], errmsg);
 			continue;
 		}
-		else
-		{
-			host_num++;
-		}
 	}
 
+	/* With -A, a name may have added several hosts. */
+	host_num = ping_iterator_count (ping);
+
 	/* Permanently drop root privileges if we're setuid-root. */
 	status = setuid (getuid ());
 	if (status != 0)
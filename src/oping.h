@@ -46,6 +46,32 @@ typedef pinghost_t pingobj_iter_t;
 struct pingobj;
 typedef struct pingobj pingobj_t;
 
+typedef void (*ping_callback_t) (pingobj_t *obj, pingobj_iter_t *iter,
+		void *arg);
+
+/* Called by ping_host_add_many for each host, in order, once it has been
+ * added (status zero) or failed to be (status less than zero, see
+ * ping_get_error). */
+typedef void (*ping_add_callback_t) (pingobj_t *obj, const char *host,
+		int status, void *arg);
+
+/* Called when the resolver cache (PING_OPT_RESOLVE_TTL together with
+ * PING_OPT_ALL_ADDRESSES) adds a host for a new address (PING_HOST_ADDED),
+ * or is about to remove the host of an address that went away
+ * (PING_HOST_REMOVED). */
+#define PING_HOST_ADDED   1
+#define PING_HOST_REMOVED 2
+typedef void (*ping_host_callback_t) (pingobj_t *obj, pingobj_iter_t *iter,
+		int event, void *arg);
+
+/* Value of PING_OPT_DATA_BINARY: "size" bytes at "data". */
+struct ping_data
+{
+	const void *data;
+	size_t      size;
+};
+typedef struct ping_data ping_data_t;
+
 #define PING_OPT_TIMEOUT 0x01
 #define PING_OPT_TTL     0x02
 #define PING_OPT_AF      0x04
@@ -54,11 +80,34 @@ typedef struct pingobj pingobj_t;
 #define PING_OPT_DEVICE  0x20
 #define PING_OPT_QOS     0x40
 #define PING_OPT_MARK    0x80
+#define PING_OPT_BATCH_SIZE 0x100
+#define PING_OPT_INTERVAL 0x200
+#define PING_OPT_TIMEOUT_ADAPTIVE 0x400
+#define PING_OPT_TIMEOUT_MIN 0x800
+#define PING_OPT_RATE 0x1000
+#define PING_OPT_SPREAD 0x2000
+#define PING_OPT_PAYLOAD_HEADER 0x4000
+#define PING_OPT_TIMESTAMPING 0x8000
+#define PING_OPT_DGRAM 0x10000
+#define PING_OPT_SKIP_CHECKSUM 0x20000
+#define PING_OPT_DATA_BINARY 0x40000
+#define PING_OPT_RESOLVE_TTL 0x80000
+#define PING_OPT_ALL_ADDRESSES 0x100000
 
 #define PING_DEF_TIMEOUT 1.0
 #define PING_DEF_TTL     255
 #define PING_DEF_AF      AF_UNSPEC
 #define PING_DEF_DATA    "liboping -- ICMP ping library <http://octo.it/liboping/>"
+/* The largest ICMPv4 echo request: 65535 bytes less the IPv4 and ICMP
+ * headers. */
+#define PING_MAX_DATA_SIZE 65507
+#define PING_DEF_BATCH_SIZE 32
+#define PING_MAX_BATCH_SIZE 1024
+#define PING_DEF_INTERVAL 1.0
+#define PING_DEF_TIMEOUT_MIN 0.01
+
+/* Number of round-trip times kept per host, see PING_INFO_RTT_HISTORY. */
+#define PING_RTT_HISTORY_LEN 16
 
 /*
  * Method definitions
@@ -70,8 +119,31 @@ int ping_setopt (pingobj_t *obj, int option, void *value);
 
 int ping_send (pingobj_t *obj);
 
+#define PING_EVENT_READ  0x01
+#define PING_EVENT_WRITE 0x02
+int ping_send_start (pingobj_t *obj);
+int ping_send_fds (pingobj_t *obj, int *fds, int *events, size_t fds_num);
+double ping_send_timeout (pingobj_t *obj);
+int ping_send_process (pingobj_t *obj, int fd, int events);
+int ping_send_finish (pingobj_t *obj);
+
+int ping_set_callback (pingobj_t *obj, ping_callback_t callback, void *arg);
+int ping_run_start (pingobj_t *obj);
+double ping_run_timeout (pingobj_t *obj);
+int ping_run_process (pingobj_t *obj, int fd, int events);
+int ping_run_stop (pingobj_t *obj);
+int ping_run (pingobj_t *obj, double duration);
+
 int ping_host_add (pingobj_t *obj, const char *host);
 int ping_host_remove (pingobj_t *obj, const char *host);
+int ping_host_add_addr (pingobj_t *obj, const char *name,
+		const struct sockaddr *addr, socklen_t addrlen);
+int ping_host_add_range (pingobj_t *obj, const char *range);
+int ping_host_add_many (pingobj_t *obj, const char * const *hosts,
+		size_t hosts_num, ping_add_callback_t callback, void *arg);
+int ping_reserve (pingobj_t *obj, size_t num);
+int ping_set_host_callback (pingobj_t *obj, ping_host_callback_t callback,
+		void *arg);
 
 pingobj_iter_t *ping_iterator_get (pingobj_t *obj);
 pingobj_iter_t *ping_iterator_next (pingobj_iter_t *iter);
@@ -88,6 +160,8 @@ int ping_iterator_count (pingobj_t *obj);
 #define PING_INFO_DROPPED   9
 #define PING_INFO_RECV_TTL 10
 #define PING_INFO_RECV_QOS 11
+#define PING_INFO_RTT_HISTORY 12
+#define PING_INFO_LATENCY_NS 13
 int ping_iterator_get_info (pingobj_iter_t *iter, int info,
 		void *buffer, size_t *buffer_len);
 
@@ -96,6 +170,8 @@ const char *ping_get_error (pingobj_t *obj);
 void *ping_iterator_get_context (pingobj_iter_t *iter);
 void  ping_iterator_set_context (pingobj_iter_t *iter, void *context);
 
+int ping_iterator_set_interval (pingobj_iter_t *iter, double interval);
+
 #ifdef __cplusplus
 }
 #endif